@@ -0,0 +1,82 @@
+#!/bin/sh
+# Times the main commands of <pyros binary> end to end on a synthetic
+# database (see gendb.sh for the settings) and prints the results as JSON.
+set -e
+
+if [ $# -ne 1 ]; then
+	echo "usage: $0 <pyros binary>" >&2
+	exit 1
+fi
+
+case "$1" in
+/*) PYROS="$1" ;;
+*) PYROS="$PWD/$1" ;;
+esac
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+
+: "${BENCH_FILES:=10000}"
+: "${BENCH_TAGS:=1000}"
+: "${BENCH_DEPTH:=4}"
+: "${BENCH_FANOUT:=5}"
+: "${BENCH_MERGE:=100}"
+: "${BENCH_REMOVE:=1000}"
+export BENCH_FILES BENCH_TAGS BENCH_DEPTH BENCH_FANOUT
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/pyros-bench.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+export PYROSDB="$WORK/db"
+export PYROS_NO_DAEMON=1
+
+sh "$BENCH_DIR/gendb.sh" "$WORK"
+"$PYROS" create >/dev/null
+
+now() {
+	date +%s%N
+}
+
+RESULTS=""
+
+# run <name> <shell command>, the command's output is discarded
+run() {
+	start=$(now)
+	if ! (eval "$2") >/dev/null; then
+		echo "$0: \"$1\" failed" >&2
+		exit 1
+	fi
+	end=$(now)
+
+	[ -n "$RESULTS" ] && RESULTS="$RESULTS,"
+	RESULTS="$RESULTS
+    {\"command\": \"$1\", \"seconds\": $(awk -v ns=$((end - start)) \
+	    'BEGIN { printf "%.6f", ns / 1e9 }')}"
+}
+
+run "add -r" '"$PYROS" add -r "$WORK/files" bench'
+run "batch add-child" '"$PYROS" batch "$WORK/relations"'
+run "batch add" '"$PYROS" batch "$WORK/tags"'
+run "search" '"$PYROS" search t0'
+run "search -H" '"$PYROS" search -H bench'
+run "list-tags" '"$PYROS" list-tags'
+run "list-hashes" '"$PYROS" list-hashes'
+run "get-related" '"$PYROS" get-related t0'
+mkdir "$WORK/export"
+run "export" '"$PYROS" export "$WORK/export" t0'
+
+"$PYROS" list-hashes | head -n "$BENCH_MERGE" >"$WORK/merge"
+"$PYROS" list-hashes | tail -n +$((BENCH_MERGE + 1)) |
+    head -n "$BENCH_REMOVE" >"$WORK/remove"
+run "merge" '"$PYROS" merge $(cat "$WORK/merge")'
+run "remove-file" '"$PYROS" remove-file -i <"$WORK/remove"'
+
+cat <<JSON
+{
+  "binary": "$1",
+  "files": $BENCH_FILES,
+  "tags": $BENCH_TAGS,
+  "depth": $BENCH_DEPTH,
+  "fanout": $BENCH_FANOUT,
+  "results": [$RESULTS
+  ]
+}
+JSON
@@ -0,0 +1,79 @@
+#!/bin/sh
+# Generates the input for a synthetic database in <dir>:
+#   files/gN/fN  BENCH_FILES files of BENCH_FILE_SIZE bytes, BENCH_GROUP
+#                to a directory
+#   relations    batch script building BENCH_TAGS tags as a forest of
+#                BENCH_FANOUT-ary trees, BENCH_DEPTH levels deep
+#   tags         batch script giving every group BENCH_TAGS_PER_GROUP tags
+# The output only depends on the settings so runs are comparable.
+set -e
+
+if [ $# -ne 1 ]; then
+	echo "usage: $0 <dir>" >&2
+	exit 1
+fi
+
+: "${BENCH_FILES:=10000}"
+: "${BENCH_FILE_SIZE:=4096}"
+: "${BENCH_GROUP:=100}"
+: "${BENCH_TAGS:=1000}"
+: "${BENCH_DEPTH:=4}"
+: "${BENCH_FANOUT:=5}"
+: "${BENCH_TAGS_PER_GROUP:=3}"
+: "${BENCH_SEED:=1}"
+
+mkdir -p "$1/files"
+
+awk -v dir="$1" -v files="$BENCH_FILES" -v size="$BENCH_FILE_SIZE" \
+    -v group="$BENCH_GROUP" -v tags="$BENCH_TAGS" -v depth="$BENCH_DEPTH" \
+    -v fanout="$BENCH_FANOUT" -v per_group="$BENCH_TAGS_PER_GROUP" \
+    -v seed="$BENCH_SEED" '
+# awk implementations disagree on rand(), use our own generator
+function next_rand(n) {
+	seed = (seed * 1103515245 + 12345) % 2147483648
+	return int(seed / 65536) % n
+}
+
+BEGIN {
+	pad = sprintf("%*s", size, "")
+	gsub(/ /, "x", pad)
+
+	# nodes in one complete tree
+	tree_size = 0
+	level = 1
+	for (d = 0; d < depth; d++) {
+		tree_size += level
+		level *= fanout
+	}
+
+	relations = dir "/relations"
+	printf "" > relations
+	for (i = 0; i < tags; i++) {
+		local = i % tree_size
+		if (local > 0) {
+			parent = i - local + int((local - 1) / fanout)
+			print "add-child t" parent " t" i > relations
+		}
+	}
+	close(relations)
+
+	tagfile = dir "/tags"
+	printf "" > tagfile
+	for (g = 0; g * group < files; g++) {
+		gdir = dir "/files/g" g
+		system("mkdir -p \"" gdir "\"")
+
+		for (i = g * group; i < files && i < (g + 1) * group; i++) {
+			path = gdir "/f" i
+			line = "file " i "\n"
+			printf "%s%s", line, substr(pad, length(line) + 1) > path
+			close(path)
+		}
+
+		line = "add " gdir
+		for (t = 0; t < per_group; t++)
+			line = line " t" next_rand(tags)
+		print line > tagfile
+	}
+	close(tagfile)
+}'
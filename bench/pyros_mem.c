@@ -0,0 +1,1254 @@
+/*
+ * In-memory stand-in for libpyros.
+ *
+ * Implements the part of the libpyros API the CLI uses on top of a few
+ * plain arrays, so the cost of the CLI itself can be measured without
+ * sqlite, file imports or libmagic in the way. The database is kept in a
+ * single text snapshot inside the database directory that is loaded on
+ * open and rewritten on commit. Files are not copied into the database,
+ * the original path is recorded instead.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+#include <pyros.h>
+
+#define SNAPSHOT_NAME "pyros-mem.db"
+#define NO_ID ((size_t)-1)
+
+struct IdArray {
+	size_t *ids;
+	size_t length;
+	size_t capacity;
+};
+
+struct MemTag {
+	char *name;
+	struct IdArray files;
+	struct IdArray parents;
+	struct IdArray children;
+	struct IdArray aliases;
+};
+
+struct MemFile {
+	char *hash;
+	char *path;
+	char *mime;
+	char *ext;
+	int64_t import_time;
+	size_t file_size;
+	struct IdArray tags;
+};
+
+/* open addressing string -> id map, ids index into the tag or file array */
+struct Map {
+	size_t *slots;
+	size_t capacity;
+	size_t length;
+};
+
+struct PyrosDB {
+	char *path;
+	enum PYROS_HASHTYPE hashtype;
+	enum PYROS_ERROR error;
+	char error_msg[256];
+
+	struct MemTag *tags;
+	size_t tag_count;
+	size_t tag_capacity;
+	struct Map tag_map;
+
+	struct MemFile *files;
+	size_t file_count;
+	size_t file_capacity;
+	struct Map file_map;
+
+	/* what the loaded snapshot looked like, to notice commits made by
+	 * other processes the way sqlite would */
+	struct timespec snapshot_mtime;
+	off_t snapshot_size;
+	int dirty;
+};
+
+static void
+oom() {
+	fprintf(stderr, "pyros-mem: Out of memory\n");
+	exit(1);
+}
+
+static void *
+xmalloc(size_t size) {
+	void *ptr = malloc(size ? size : 1);
+	if (ptr == NULL)
+		oom();
+	return ptr;
+}
+
+static void *
+xrealloc(void *ptr, size_t size) {
+	ptr = realloc(ptr, size ? size : 1);
+	if (ptr == NULL)
+		oom();
+	return ptr;
+}
+
+static char *
+xstrdup(const char *str) {
+	size_t len = strlen(str) + 1;
+	return memcpy(xmalloc(len), str, len);
+}
+
+static enum PYROS_ERROR
+set_error(PyrosDB *pyrosDB, enum PYROS_ERROR error, const char *msg) {
+	pyrosDB->error = error;
+	snprintf(pyrosDB->error_msg, sizeof(pyrosDB->error_msg), "%s", msg);
+	return error;
+}
+
+static enum PYROS_ERROR load_snapshot(PyrosDB *pyrosDB);
+static char *snapshot_path(const PyrosDB *pyrosDB, const char *suffix);
+
+static int
+stat_snapshot(const PyrosDB *pyrosDB, struct stat *statbuf) {
+	char *path = snapshot_path(pyrosDB, "");
+	int ret = stat(path, statbuf);
+	free(path);
+	return ret;
+}
+
+static void
+remember_snapshot(PyrosDB *pyrosDB) {
+	struct stat statbuf;
+
+	if (stat_snapshot(pyrosDB, &statbuf) == 0) {
+		pyrosDB->snapshot_mtime = statbuf.st_mtim;
+		pyrosDB->snapshot_size = statbuf.st_size;
+	}
+	pyrosDB->dirty = 0;
+}
+
+/* every entry point starts here, reload if someone else committed since
+ * and there is nothing uncommitted to lose */
+static void
+clear_error(PyrosDB *pyrosDB) {
+	struct stat statbuf;
+
+	pyrosDB->error = PYROS_OK;
+	pyrosDB->error_msg[0] = '\0';
+
+	if (pyrosDB->dirty || stat_snapshot(pyrosDB, &statbuf))
+		return;
+
+	if (statbuf.st_size != pyrosDB->snapshot_size ||
+	    statbuf.st_mtim.tv_sec != pyrosDB->snapshot_mtime.tv_sec ||
+	    statbuf.st_mtim.tv_nsec != pyrosDB->snapshot_mtime.tv_nsec)
+		load_snapshot(pyrosDB);
+}
+
+/* id arrays */
+
+static int
+ids_contains(const struct IdArray *array, size_t id) {
+	for (size_t i = 0; i < array->length; i++)
+		if (array->ids[i] == id)
+			return 1;
+	return 0;
+}
+
+static void
+ids_append(struct IdArray *array, size_t id) {
+	if (array->length >= array->capacity) {
+		array->capacity = array->capacity ? array->capacity * 2 : 4;
+		array->ids = xrealloc(array->ids,
+		                      sizeof(*array->ids) * array->capacity);
+	}
+	array->ids[array->length++] = id;
+}
+
+static int
+ids_add(struct IdArray *array, size_t id) {
+	if (ids_contains(array, id))
+		return 0;
+	ids_append(array, id);
+	return 1;
+}
+
+static void
+ids_remove(struct IdArray *array, size_t id) {
+	for (size_t i = 0; i < array->length; i++) {
+		if (array->ids[i] == id) {
+			array->ids[i] = array->ids[--array->length];
+			return;
+		}
+	}
+}
+
+/* maps */
+
+static size_t
+hash_str(const char *str) {
+	size_t h = 14695981039346656037ULL;
+	while (*str)
+		h = (h ^ (unsigned char)*str++) * 1099511628211ULL;
+	return h;
+}
+
+static size_t
+map_find_slot(const struct Map *map, const char *key, char **(*name_of)(
+                  const PyrosDB *, size_t),
+              const PyrosDB *pyrosDB) {
+	size_t slot = hash_str(key) & (map->capacity - 1);
+
+	while (map->slots[slot] != NO_ID &&
+	       strcmp(*name_of(pyrosDB, map->slots[slot]), key))
+		slot = (slot + 1) & (map->capacity - 1);
+	return slot;
+}
+
+static char **
+tag_name(const PyrosDB *pyrosDB, size_t id) {
+	return &pyrosDB->tags[id].name;
+}
+
+static char **
+file_hash(const PyrosDB *pyrosDB, size_t id) {
+	return &pyrosDB->files[id].hash;
+}
+
+static void map_insert(struct Map *map, size_t id,
+                       char **(*name_of)(const PyrosDB *, size_t),
+                       const PyrosDB *pyrosDB);
+
+static void
+map_grow(struct Map *map, char **(*name_of)(const PyrosDB *, size_t),
+         const PyrosDB *pyrosDB) {
+	size_t *old = map->slots;
+	size_t old_capacity = map->capacity;
+
+	map->capacity = old_capacity ? old_capacity * 2 : 64;
+	map->slots = xmalloc(sizeof(*map->slots) * map->capacity);
+	memset(map->slots, 0xff, sizeof(*map->slots) * map->capacity);
+	map->length = 0;
+
+	for (size_t i = 0; i < old_capacity; i++)
+		if (old[i] != NO_ID)
+			map_insert(map, old[i], name_of, pyrosDB);
+	free(old);
+}
+
+static void
+map_insert(struct Map *map, size_t id,
+           char **(*name_of)(const PyrosDB *, size_t),
+           const PyrosDB *pyrosDB) {
+	size_t slot;
+
+	if ((map->length + 1) * 2 > map->capacity)
+		map_grow(map, name_of, pyrosDB);
+
+	slot = map_find_slot(map, *name_of(pyrosDB, id), name_of, pyrosDB);
+	map->slots[slot] = id;
+	map->length++;
+}
+
+static size_t
+map_get(const struct Map *map, const char *key,
+        char **(*name_of)(const PyrosDB *, size_t), const PyrosDB *pyrosDB) {
+	if (map->capacity == 0)
+		return NO_ID;
+	return map->slots[map_find_slot(map, key, name_of, pyrosDB)];
+}
+
+/* removal by rebuilding keeps probing simple, removals are rare */
+static void
+map_rebuild(struct Map *map, size_t count,
+            char **(*name_of)(const PyrosDB *, size_t),
+            const PyrosDB *pyrosDB) {
+	free(map->slots);
+	map->slots = NULL;
+	map->capacity = 0;
+	map->length = 0;
+	map_grow(map, name_of, pyrosDB);
+
+	for (size_t i = 0; i < count; i++)
+		if (*name_of(pyrosDB, i) != NULL)
+			map_insert(map, i, name_of, pyrosDB);
+}
+
+/* tags and files */
+
+static size_t
+find_tag(PyrosDB *pyrosDB, const char *tag) {
+	return map_get(&pyrosDB->tag_map, tag, &tag_name, pyrosDB);
+}
+
+static size_t
+get_tag(PyrosDB *pyrosDB, const char *tag) {
+	size_t id = find_tag(pyrosDB, tag);
+	if (id != NO_ID)
+		return id;
+
+	if (pyrosDB->tag_count >= pyrosDB->tag_capacity) {
+		pyrosDB->tag_capacity =
+		    pyrosDB->tag_capacity ? pyrosDB->tag_capacity * 2 : 64;
+		pyrosDB->tags =
+		    xrealloc(pyrosDB->tags,
+		             sizeof(*pyrosDB->tags) * pyrosDB->tag_capacity);
+	}
+
+	id = pyrosDB->tag_count++;
+	memset(&pyrosDB->tags[id], 0, sizeof(*pyrosDB->tags));
+	pyrosDB->tags[id].name = xstrdup(tag);
+	map_insert(&pyrosDB->tag_map, id, &tag_name, pyrosDB);
+	return id;
+}
+
+static size_t
+find_file(PyrosDB *pyrosDB, const char *hash) {
+	return map_get(&pyrosDB->file_map, hash, &file_hash, pyrosDB);
+}
+
+static size_t
+new_file(PyrosDB *pyrosDB, const char *hash) {
+	size_t id;
+
+	if (pyrosDB->file_count >= pyrosDB->file_capacity) {
+		pyrosDB->file_capacity =
+		    pyrosDB->file_capacity ? pyrosDB->file_capacity * 2 : 64;
+		pyrosDB->files =
+		    xrealloc(pyrosDB->files,
+		             sizeof(*pyrosDB->files) * pyrosDB->file_capacity);
+	}
+
+	id = pyrosDB->file_count++;
+	memset(&pyrosDB->files[id], 0, sizeof(*pyrosDB->files));
+	pyrosDB->files[id].hash = xstrdup(hash);
+	map_insert(&pyrosDB->file_map, id, &file_hash, pyrosDB);
+	return id;
+}
+
+static void
+tag_file(PyrosDB *pyrosDB, size_t file, const char *tag) {
+	size_t id;
+
+	if (tag[0] == '\0')
+		return;
+
+	id = get_tag(pyrosDB, tag);
+	if (ids_add(&pyrosDB->files[file].tags, id))
+		ids_append(&pyrosDB->tags[id].files, file);
+}
+
+static void
+untag_file(PyrosDB *pyrosDB, size_t file, size_t tag) {
+	ids_remove(&pyrosDB->files[file].tags, tag);
+	ids_remove(&pyrosDB->tags[tag].files, file);
+}
+
+static void
+free_contents(PyrosDB *pyrosDB) {
+	for (size_t i = 0; i < pyrosDB->tag_count; i++) {
+		struct MemTag *tag = &pyrosDB->tags[i];
+		free(tag->name);
+		free(tag->files.ids);
+		free(tag->parents.ids);
+		free(tag->children.ids);
+		free(tag->aliases.ids);
+	}
+	for (size_t i = 0; i < pyrosDB->file_count; i++) {
+		struct MemFile *file = &pyrosDB->files[i];
+		free(file->hash);
+		free(file->path);
+		free(file->mime);
+		free(file->ext);
+		free(file->tags.ids);
+	}
+	free(pyrosDB->tags);
+	free(pyrosDB->files);
+	free(pyrosDB->tag_map.slots);
+	free(pyrosDB->file_map.slots);
+
+	pyrosDB->tags = NULL;
+	pyrosDB->files = NULL;
+	pyrosDB->tag_count = pyrosDB->tag_capacity = 0;
+	pyrosDB->file_count = pyrosDB->file_capacity = 0;
+	memset(&pyrosDB->tag_map, 0, sizeof(pyrosDB->tag_map));
+	memset(&pyrosDB->file_map, 0, sizeof(pyrosDB->file_map));
+}
+
+/* snapshot */
+
+static char *
+snapshot_path(const PyrosDB *pyrosDB, const char *suffix) {
+	size_t len = strlen(pyrosDB->path);
+	char *path = xmalloc(len + strlen(SNAPSHOT_NAME) + strlen(suffix) + 2);
+
+	strcpy(path, pyrosDB->path);
+	if (len == 0 || path[len - 1] != '/')
+		strcat(path, "/");
+	strcat(path, SNAPSHOT_NAME);
+	strcat(path, suffix);
+	return path;
+}
+
+/* splits line on tabs in place, returns the number of fields */
+static size_t
+split_fields(char *line, char **fields, size_t max) {
+	size_t count = 0;
+
+	fields[count++] = line;
+	while (*line && count < max) {
+		if (*line == '\t') {
+			*line = '\0';
+			fields[count++] = line + 1;
+		}
+		line++;
+	}
+	return count;
+}
+
+static enum PYROS_ERROR
+load_snapshot(PyrosDB *pyrosDB) {
+	char *path = snapshot_path(pyrosDB, "");
+	FILE *snapshot = fopen(path, "r");
+	char *line = NULL;
+	size_t line_capacity = 0;
+	ssize_t length;
+	char *fields[8];
+	size_t field_count;
+	size_t file = NO_ID;
+
+	free(path);
+	free_contents(pyrosDB);
+
+	if (snapshot == NULL)
+		return set_error(pyrosDB, PYROS_ERROR_DATABASE,
+		                 "unable to open database snapshot");
+
+	while ((length = getline(&line, &line_capacity, snapshot)) > 0) {
+		if (line[length - 1] == '\n')
+			line[length - 1] = '\0';
+
+		field_count = split_fields(line, fields, 8);
+		if (!strcmp(fields[0], "hashtype") && field_count == 2) {
+			pyrosDB->hashtype = atoi(fields[1]);
+		} else if (!strcmp(fields[0], "file") && field_count == 7) {
+			file = new_file(pyrosDB, fields[1]);
+			pyrosDB->files[file].file_size = strtoull(fields[2],
+			                                          NULL, 10);
+			pyrosDB->files[file].import_time =
+			    strtoll(fields[3], NULL, 10);
+			pyrosDB->files[file].ext = xstrdup(fields[4]);
+			pyrosDB->files[file].mime = xstrdup(fields[5]);
+			pyrosDB->files[file].path = xstrdup(fields[6]);
+		} else if (!strcmp(fields[0], "tag") && field_count == 2) {
+			if (file != NO_ID)
+				tag_file(pyrosDB, file, fields[1]);
+		} else if (!strcmp(fields[0], "parent") && field_count == 3) {
+			size_t child = get_tag(pyrosDB, fields[1]);
+			size_t parent = get_tag(pyrosDB, fields[2]);
+			ids_add(&pyrosDB->tags[child].parents, parent);
+			ids_add(&pyrosDB->tags[parent].children, child);
+		} else if (!strcmp(fields[0], "alias") && field_count == 3) {
+			size_t a = get_tag(pyrosDB, fields[1]);
+			size_t b = get_tag(pyrosDB, fields[2]);
+			ids_add(&pyrosDB->tags[a].aliases, b);
+			ids_add(&pyrosDB->tags[b].aliases, a);
+		} else if (!strcmp(fields[0], "name") && field_count == 2) {
+			get_tag(pyrosDB, fields[1]);
+		}
+	}
+
+	free(line);
+	fclose(snapshot);
+	remember_snapshot(pyrosDB);
+	return PYROS_OK;
+}
+
+static enum PYROS_ERROR
+save_snapshot(PyrosDB *pyrosDB) {
+	char *path = snapshot_path(pyrosDB, "");
+	char *tmp_path = snapshot_path(pyrosDB, ".tmp");
+	FILE *snapshot = fopen(tmp_path, "w");
+
+	if (snapshot == NULL) {
+		free(path);
+		free(tmp_path);
+		return set_error(pyrosDB, PYROS_ERROR_DATABASE,
+		                 "unable to write database snapshot");
+	}
+
+	fprintf(snapshot, "hashtype\t%d\n", (int)pyrosDB->hashtype);
+	for (size_t i = 0; i < pyrosDB->tag_count; i++)
+		if (pyrosDB->tags[i].name != NULL)
+			fprintf(snapshot, "name\t%s\n", pyrosDB->tags[i].name);
+
+	for (size_t i = 0; i < pyrosDB->file_count; i++) {
+		struct MemFile *file = &pyrosDB->files[i];
+		if (file->hash == NULL)
+			continue;
+
+		fprintf(snapshot, "file\t%s\t%zu\t%lld\t%s\t%s\t%s\n",
+		        file->hash, file->file_size,
+		        (long long)file->import_time, file->ext, file->mime,
+		        file->path);
+		for (size_t j = 0; j < file->tags.length; j++)
+			fprintf(snapshot, "tag\t%s\n",
+			        pyrosDB->tags[file->tags.ids[j]].name);
+	}
+
+	for (size_t i = 0; i < pyrosDB->tag_count; i++) {
+		struct MemTag *tag = &pyrosDB->tags[i];
+		for (size_t j = 0; j < tag->parents.length; j++)
+			fprintf(snapshot, "parent\t%s\t%s\n", tag->name,
+			        pyrosDB->tags[tag->parents.ids[j]].name);
+		for (size_t j = 0; j < tag->aliases.length; j++)
+			if (tag->aliases.ids[j] > i)
+				fprintf(snapshot, "alias\t%s\t%s\n", tag->name,
+				        pyrosDB->tags[tag->aliases.ids[j]].name);
+	}
+
+	if (fclose(snapshot) || rename(tmp_path, path)) {
+		free(path);
+		free(tmp_path);
+		return set_error(pyrosDB, PYROS_ERROR_DATABASE,
+		                 "unable to write database snapshot");
+	}
+
+	free(path);
+	free(tmp_path);
+	remember_snapshot(pyrosDB);
+	return PYROS_OK;
+}
+
+/* lists */
+
+PyrosList *
+Pyros_Create_List(size_t elements) {
+	PyrosList *pList = malloc(sizeof(*pList));
+	if (pList == NULL)
+		return NULL;
+
+	pList->size = elements + 1;
+	pList->length = 0;
+	pList->list = malloc(sizeof(*pList->list) * pList->size);
+	if (pList->list == NULL) {
+		free(pList);
+		return NULL;
+	}
+	pList->list[0] = NULL;
+	return pList;
+}
+
+enum PYROS_ERROR
+Pyros_List_Append(PyrosList *pList, const void *ptr) {
+	if (pList->length + 1 >= pList->size) {
+		void **list = realloc(pList->list,
+		                      sizeof(*pList->list) * pList->size * 2);
+		if (list == NULL)
+			return PYROS_ERROR_OOM;
+		pList->list = list;
+		pList->size *= 2;
+	}
+	pList->list[pList->length++] = (void *)ptr;
+	pList->list[pList->length] = NULL;
+	return PYROS_OK;
+}
+
+enum PYROS_ERROR
+Pyros_List_Clear(PyrosList *pList, Pyros_Free_Callback cb) {
+	if (cb != NULL)
+		for (size_t i = 0; i < pList->length; i++)
+			cb(pList->list[i]);
+	pList->length = 0;
+	pList->list[0] = NULL;
+	return PYROS_OK;
+}
+
+void
+Pyros_List_Free(PyrosList *pList, Pyros_Free_Callback cb) {
+	if (pList == NULL)
+		return;
+	Pyros_List_Clear(pList, cb);
+	free(pList->list);
+	free(pList);
+}
+
+void
+Pyros_Free_File(PyrosFile *pFile) {
+	if (pFile == NULL)
+		return;
+	free(pFile->path);
+	free(pFile->hash);
+	free(pFile->mime);
+	free(pFile->ext);
+	free(pFile);
+}
+
+void
+Pyros_Free_Tag(PyrosTag *pTag) {
+	if (pTag == NULL)
+		return;
+	free(pTag->tag);
+	free(pTag);
+}
+
+/* database */
+
+int
+Pyros_Database_Exists(const char *path) {
+	PyrosDB tmp;
+	struct stat statbuf;
+	char *snapshot;
+	int exists;
+
+	tmp.path = (char *)path;
+	snapshot = snapshot_path(&tmp, "");
+	exists = stat(snapshot, &statbuf) == 0;
+	free(snapshot);
+	return exists;
+}
+
+PyrosDB *
+Pyros_Alloc_Database(const char *path) {
+	PyrosDB *pyrosDB = calloc(1, sizeof(*pyrosDB));
+	if (pyrosDB == NULL)
+		return NULL;
+
+	pyrosDB->path = strdup(path);
+	if (pyrosDB->path == NULL) {
+		free(pyrosDB);
+		return NULL;
+	}
+	pyrosDB->hashtype = PYROS_BLAKE2BHASH;
+	return pyrosDB;
+}
+
+enum PYROS_ERROR
+Pyros_Open_Database(PyrosDB *pyrosDB) {
+	clear_error(pyrosDB);
+	return load_snapshot(pyrosDB);
+}
+
+static int
+mkdir_p(const char *path) {
+	char *tmp = xstrdup(path);
+	int ret = 0;
+
+	for (char *p = tmp + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		if (mkdir(tmp, 0755) && errno != EEXIST)
+			ret = -1;
+		*p = '/';
+	}
+	if (mkdir(tmp, 0755) && errno != EEXIST)
+		ret = -1;
+
+	free(tmp);
+	return ret;
+}
+
+enum PYROS_ERROR
+Pyros_Create_Database(PyrosDB *pyrosDB, enum PYROS_HASHTYPE hashtype) {
+	clear_error(pyrosDB);
+	pyrosDB->dirty = 1;
+	if (mkdir_p(pyrosDB->path))
+		return set_error(pyrosDB, PYROS_ERROR_DATABASE,
+		                 "unable to create database directory");
+
+	pyrosDB->hashtype = hashtype;
+	return PYROS_OK;
+}
+
+enum PYROS_ERROR
+Pyros_Commit(PyrosDB *pyrosDB) {
+	clear_error(pyrosDB);
+	return save_snapshot(pyrosDB);
+}
+
+enum PYROS_ERROR
+Pyros_Rollback(PyrosDB *pyrosDB) {
+	enum PYROS_ERROR error = pyrosDB->error;
+	char msg[sizeof(pyrosDB->error_msg)];
+
+	/* keep the error that caused the rollback around */
+	memcpy(msg, pyrosDB->error_msg, sizeof(msg));
+	if (Pyros_Database_Exists(pyrosDB->path))
+		load_snapshot(pyrosDB);
+	else
+		free_contents(pyrosDB);
+	pyrosDB->error = error;
+	memcpy(pyrosDB->error_msg, msg, sizeof(msg));
+	return PYROS_OK;
+}
+
+enum PYROS_ERROR
+Pyros_Close_Database(PyrosDB *pyrosDB) {
+	free_contents(pyrosDB);
+	free(pyrosDB->path);
+	free(pyrosDB);
+	return PYROS_OK;
+}
+
+enum PYROS_ERROR
+Pyros_Vacuum_Database(PyrosDB *pyrosDB) {
+	clear_error(pyrosDB);
+	return PYROS_OK;
+}
+
+enum PYROS_ERROR
+Pyros_Get_Error_Type(PyrosDB *pyrosDB) {
+	return pyrosDB->error;
+}
+
+const char *
+Pyros_Get_Error_Message(PyrosDB *pyrosDB) {
+	return pyrosDB->error_msg;
+}
+
+enum PYROS_HASHTYPE
+Pyros_Get_Hash_Type(PyrosDB *pyrosDB) {
+	return pyrosDB->hashtype;
+}
+
+/* adding files */
+
+static const EVP_MD *
+get_md(enum PYROS_HASHTYPE hashtype) {
+	switch (hashtype) {
+	case PYROS_MD5HASH:
+		return EVP_md5();
+	case PYROS_SHA1HASH:
+		return EVP_sha1();
+	case PYROS_SHA256HASH:
+		return EVP_sha256();
+	case PYROS_SHA512HASH:
+		return EVP_sha512();
+	case PYROS_BLAKE2SHASH:
+		return EVP_blake2s256();
+	case PYROS_BLAKE2BHASH:
+	default:
+		return EVP_blake2b512();
+	}
+}
+
+static char *
+hash_path(PyrosDB *pyrosDB, const char *path, size_t *size) {
+	static const char hex[] = "0123456789abcdef";
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned char buf[1 << 16];
+	unsigned int digest_len;
+	EVP_MD_CTX *ctx;
+	ssize_t read_bytes;
+	char *hash;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+
+	ctx = EVP_MD_CTX_new();
+	EVP_DigestInit_ex(ctx, get_md(pyrosDB->hashtype), NULL);
+	*size = 0;
+	while ((read_bytes = read(fd, buf, sizeof(buf))) > 0) {
+		EVP_DigestUpdate(ctx, buf, read_bytes);
+		*size += read_bytes;
+	}
+	EVP_DigestFinal_ex(ctx, digest, &digest_len);
+	EVP_MD_CTX_free(ctx);
+	close(fd);
+
+	hash = xmalloc(digest_len * 2 + 1);
+	for (unsigned int i = 0; i < digest_len; i++) {
+		hash[i * 2] = hex[digest[i] >> 4];
+		hash[i * 2 + 1] = hex[digest[i] & 0xf];
+	}
+	hash[digest_len * 2] = '\0';
+	return hash;
+}
+
+static void
+read_tag_file(PyrosDB *pyrosDB, size_t file, const char *path) {
+	char *tag_path = xmalloc(strlen(path) + 5);
+	char *line = NULL;
+	size_t line_capacity = 0;
+	ssize_t length;
+	FILE *fp;
+
+	strcpy(tag_path, path);
+	strcat(tag_path, ".txt");
+	fp = fopen(tag_path, "r");
+	free(tag_path);
+	if (fp == NULL)
+		return;
+
+	while ((length = getline(&line, &line_capacity, fp)) > 0) {
+		if (line[length - 1] == '\n')
+			line[length - 1] = '\0';
+		tag_file(pyrosDB, file, line);
+	}
+	free(line);
+	fclose(fp);
+}
+
+enum PYROS_ERROR
+Pyros_Add_Full(PyrosDB *pyrosDB, const char **filePaths, size_t filec,
+               const char **tags, size_t tagc, int useTagfile,
+               int returnHashes, Pyros_Add_Full_Callback callback,
+               void *callback_data) {
+	char *hash;
+	const char *ext;
+	size_t size;
+	size_t file;
+	char *real;
+
+	(void)returnHashes;
+	clear_error(pyrosDB);
+	pyrosDB->dirty = 1;
+
+	for (size_t i = 0; i < filec; i++) {
+		if ((hash = hash_path(pyrosDB, filePaths[i], &size)) == NULL)
+			return set_error(pyrosDB, PYROS_ERROR_INVALID_ARGUMENT,
+			                 "unable to read file");
+
+		if ((file = find_file(pyrosDB, hash)) == NO_ID) {
+			file = new_file(pyrosDB, hash);
+			ext = strrchr(filePaths[i], '.');
+			if (ext == NULL || strchr(ext, '/') != NULL)
+				ext = "";
+			else
+				ext++;
+
+			real = realpath(filePaths[i], NULL);
+			pyrosDB->files[file].path =
+			    real ? real : xstrdup(filePaths[i]);
+			pyrosDB->files[file].ext = xstrdup(ext);
+			pyrosDB->files[file].mime =
+			    xstrdup("application/octet-stream");
+			pyrosDB->files[file].file_size = size;
+			pyrosDB->files[file].import_time = time(NULL);
+		}
+
+		for (size_t j = 0; j < tagc; j++)
+			tag_file(pyrosDB, file, tags[j]);
+		if (useTagfile)
+			read_tag_file(pyrosDB, file, filePaths[i]);
+
+		if (callback != NULL)
+			callback(hash, filePaths[i], i, callback_data);
+		free(hash);
+	}
+
+	return PYROS_OK;
+}
+
+enum PYROS_ERROR
+Pyros_Add_Tag(PyrosDB *pyrosDB, const char *hash, const char **tags,
+              size_t tagc) {
+	size_t file;
+
+	clear_error(pyrosDB);
+	pyrosDB->dirty = 1;
+	if ((file = find_file(pyrosDB, hash)) == NO_ID)
+		return PYROS_OK;
+
+	for (size_t i = 0; i < tagc; i++)
+		tag_file(pyrosDB, file, tags[i]);
+	return PYROS_OK;
+}
+
+enum PYROS_ERROR
+Pyros_Add_Alias(PyrosDB *pyrosDB, const char *tag, const char *alias) {
+	size_t a, b;
+
+	clear_error(pyrosDB);
+	pyrosDB->dirty = 1;
+	a = get_tag(pyrosDB, tag);
+	b = get_tag(pyrosDB, alias);
+	if (a != b) {
+		ids_add(&pyrosDB->tags[a].aliases, b);
+		ids_add(&pyrosDB->tags[b].aliases, a);
+	}
+	return PYROS_OK;
+}
+
+enum PYROS_ERROR
+Pyros_Add_Parent(PyrosDB *pyrosDB, const char *parent, const char *child) {
+	size_t c, p;
+
+	clear_error(pyrosDB);
+	pyrosDB->dirty = 1;
+	c = get_tag(pyrosDB, child);
+	p = get_tag(pyrosDB, parent);
+	if (c != p) {
+		ids_add(&pyrosDB->tags[c].parents, p);
+		ids_add(&pyrosDB->tags[p].children, c);
+	}
+	return PYROS_OK;
+}
+
+/* queries */
+
+static PyrosList *
+new_list(size_t elements) {
+	PyrosList *pList = Pyros_Create_List(elements);
+	if (pList == NULL)
+		oom();
+	return pList;
+}
+
+static PyrosFile *
+copy_file(const struct MemFile *file) {
+	PyrosFile *pFile = xmalloc(sizeof(*pFile));
+
+	pFile->hash = xstrdup(file->hash);
+	pFile->path = xstrdup(file->path);
+	pFile->mime = xstrdup(file->mime);
+	pFile->ext = xstrdup(file->ext);
+	pFile->import_time = file->import_time;
+	pFile->file_size = file->file_size;
+	return pFile;
+}
+
+/* breadth first walk over aliases and (with PYROS_CHILD) children or
+ * (with PYROS_PARENT) parents, par is the index of the tag it was reached
+ * from */
+static PyrosList *
+related_tags(PyrosDB *pyrosDB, size_t root, unsigned int type) {
+	PyrosList *related = new_list(8);
+	size_t *ids = xmalloc(sizeof(*ids) * (pyrosDB->tag_count + 1));
+	char *seen = calloc(pyrosDB->tag_count + 1, 1);
+	size_t count = 0;
+	PyrosTag *pTag;
+
+	if (seen == NULL)
+		oom();
+
+	ids[count++] = root;
+	seen[root] = 1;
+	pTag = xmalloc(sizeof(*pTag));
+	pTag->tag = xstrdup(pyrosDB->tags[root].name);
+	pTag->isAlias = 0;
+	pTag->par = -1;
+	Pyros_List_Append(related, pTag);
+
+	for (size_t i = 0; i < count; i++) {
+		struct MemTag *tag = &pyrosDB->tags[ids[i]];
+		struct IdArray *lists[3] = {&tag->aliases, NULL, NULL};
+
+		if (type & PYROS_CHILD)
+			lists[1] = &tag->children;
+		if (type & PYROS_PARENT)
+			lists[2] = &tag->parents;
+
+		for (int l = 0; l < 3; l++) {
+			if (lists[l] == NULL || (l == 0 && !(type & PYROS_ALIAS)))
+				continue;
+
+			for (size_t j = 0; j < lists[l]->length; j++) {
+				size_t id = lists[l]->ids[j];
+				if (seen[id])
+					continue;
+				seen[id] = 1;
+				ids[count++] = id;
+
+				pTag = xmalloc(sizeof(*pTag));
+				pTag->tag = xstrdup(pyrosDB->tags[id].name);
+				pTag->isAlias = l == 0;
+				pTag->par = i;
+				Pyros_List_Append(related, pTag);
+			}
+		}
+	}
+
+	free(ids);
+	free(seen);
+	return related;
+}
+
+PyrosList *
+Pyros_Get_Related_Tags(PyrosDB *pyrosDB, const char *orig_tag,
+                       unsigned int type) {
+	size_t id;
+
+	clear_error(pyrosDB);
+	if ((id = find_tag(pyrosDB, orig_tag)) == NO_ID)
+		return new_list(0);
+	return related_tags(pyrosDB, id, type);
+}
+
+/* every tag matching the (possibly globbed) query and everything related to
+ * it, as a byte per tag */
+static char *
+expand_query(PyrosDB *pyrosDB, const char *query) {
+	char *matched = calloc(pyrosDB->tag_count + 1, 1);
+	PyrosList *related;
+	size_t id;
+
+	if (matched == NULL)
+		oom();
+
+	for (id = 0; id < pyrosDB->tag_count; id++) {
+		if (pyrosDB->tags[id].name == NULL || matched[id])
+			continue;
+		if (strchr(query, '*') != NULL
+		        ? fnmatch(query, pyrosDB->tags[id].name, 0) != 0
+		        : strcmp(query, pyrosDB->tags[id].name) != 0)
+			continue;
+
+		related = related_tags(pyrosDB, id, PYROS_FILE_RELATIONSHIP);
+		for (size_t i = 0; i < related->length; i++)
+			matched[find_tag(pyrosDB,
+			                 ((PyrosTag *)related->list[i])->tag)] =
+			    1;
+		Pyros_List_Free(related, (Pyros_Free_Callback)Pyros_Free_Tag);
+	}
+	return matched;
+}
+
+static int
+file_matches(PyrosDB *pyrosDB, size_t file, const char *matched) {
+	const struct IdArray *tags = &pyrosDB->files[file].tags;
+	for (size_t i = 0; i < tags->length; i++)
+		if (matched[tags->ids[i]])
+			return 1;
+	return 0;
+}
+
+PyrosList *
+Pyros_Search(PyrosDB *pyrosDB, const char **rawTags, size_t tagc) {
+	PyrosList *files = new_list(8);
+	char **matched = xmalloc(sizeof(*matched) * (tagc + 1));
+	int *negated = xmalloc(sizeof(*negated) * (tagc + 1));
+	size_t file;
+	size_t i;
+
+	clear_error(pyrosDB);
+	for (i = 0; i < tagc; i++) {
+		negated[i] = rawTags[i][0] == '-';
+		matched[i] = expand_query(pyrosDB, rawTags[i] + negated[i]);
+	}
+
+	for (file = 0; file < pyrosDB->file_count; file++) {
+		if (pyrosDB->files[file].hash == NULL)
+			continue;
+
+		for (i = 0; i < tagc; i++)
+			if (file_matches(pyrosDB, file, matched[i]) ==
+			    negated[i])
+				break;
+
+		if (i == tagc)
+			Pyros_List_Append(files,
+			                  copy_file(&pyrosDB->files[file]));
+	}
+
+	for (i = 0; i < tagc; i++)
+		free(matched[i]);
+	free(matched);
+	free(negated);
+	return files;
+}
+
+PyrosList *
+Pyros_Get_All_Hashes(PyrosDB *pyrosDB) {
+	PyrosList *hashes = new_list(pyrosDB->file_count);
+
+	clear_error(pyrosDB);
+	for (size_t i = 0; i < pyrosDB->file_count; i++)
+		if (pyrosDB->files[i].hash != NULL)
+			Pyros_List_Append(hashes,
+			                  xstrdup(pyrosDB->files[i].hash));
+	return hashes;
+}
+
+PyrosList *
+Pyros_Get_All_Tags(PyrosDB *pyrosDB) {
+	PyrosList *tags = new_list(pyrosDB->tag_count);
+
+	clear_error(pyrosDB);
+	for (size_t i = 0; i < pyrosDB->tag_count; i++)
+		if (pyrosDB->tags[i].name != NULL)
+			Pyros_List_Append(tags, xstrdup(pyrosDB->tags[i].name));
+	return tags;
+}
+
+static PyrosList *
+tag_names(PyrosDB *pyrosDB, const char *tag, size_t offset) {
+	PyrosList *names = new_list(4);
+	struct IdArray *ids;
+	size_t id;
+
+	clear_error(pyrosDB);
+	if ((id = find_tag(pyrosDB, tag)) == NO_ID)
+		return names;
+
+	ids = (struct IdArray *)((char *)&pyrosDB->tags[id] + offset);
+	for (size_t i = 0; i < ids->length; i++)
+		Pyros_List_Append(names,
+		                  xstrdup(pyrosDB->tags[ids->ids[i]].name));
+	return names;
+}
+
+PyrosList *
+Pyros_Get_Aliases(PyrosDB *pyrosDB, const char *tag) {
+	return tag_names(pyrosDB, tag, offsetof(struct MemTag, aliases));
+}
+
+PyrosList *
+Pyros_Get_Children(PyrosDB *pyrosDB, const char *tag) {
+	return tag_names(pyrosDB, tag, offsetof(struct MemTag, children));
+}
+
+PyrosList *
+Pyros_Get_Parents(PyrosDB *pyrosDB, const char *tag) {
+	return tag_names(pyrosDB, tag, offsetof(struct MemTag, parents));
+}
+
+PyrosList *
+Pyros_Get_Tags_From_Hash_Simple(PyrosDB *pyrosDB, const char *hash,
+                                int showExt) {
+	PyrosList *tags = new_list(4);
+	size_t file;
+
+	(void)showExt;
+	clear_error(pyrosDB);
+	if ((file = find_file(pyrosDB, hash)) == NO_ID)
+		return tags;
+
+	for (size_t i = 0; i < pyrosDB->files[file].tags.length; i++)
+		Pyros_List_Append(
+		    tags, xstrdup(pyrosDB->tags[pyrosDB->files[file]
+		                                    .tags.ids[i]]
+		                      .name));
+	return tags;
+}
+
+PyrosFile *
+Pyros_Get_File_From_Hash(PyrosDB *pyrosDB, const char *hash) {
+	size_t file;
+
+	clear_error(pyrosDB);
+	if ((file = find_file(pyrosDB, hash)) == NO_ID)
+		return NULL;
+	return copy_file(&pyrosDB->files[file]);
+}
+
+/* removal */
+
+static void
+remove_file(PyrosDB *pyrosDB, size_t file) {
+	struct MemFile *pFile = &pyrosDB->files[file];
+
+	while (pFile->tags.length > 0)
+		untag_file(pyrosDB, file, pFile->tags.ids[0]);
+
+	free(pFile->hash);
+	pFile->hash = NULL;
+	map_rebuild(&pyrosDB->file_map, pyrosDB->file_count, &file_hash,
+	            pyrosDB);
+}
+
+enum PYROS_ERROR
+Pyros_Merge_Hashes(PyrosDB *pyrosDB, const char *masterHash,
+                   const char *hash2, int copytags) {
+	size_t master, merged;
+
+	clear_error(pyrosDB);
+	pyrosDB->dirty = 1;
+	master = find_file(pyrosDB, masterHash);
+	merged = find_file(pyrosDB, hash2);
+	if (master == NO_ID || merged == NO_ID || master == merged)
+		return PYROS_OK;
+
+	if (copytags) {
+		struct IdArray *tags = &pyrosDB->files[merged].tags;
+		for (size_t i = 0; i < tags->length; i++)
+			tag_file(pyrosDB, master,
+			         pyrosDB->tags[tags->ids[i]].name);
+	}
+	remove_file(pyrosDB, merged);
+	return PYROS_OK;
+}
+
+enum PYROS_ERROR
+Pyros_Remove_Tag_Relationship(PyrosDB *pyrosDB, const char *tag1,
+                              const char *tag2) {
+	size_t a, b;
+
+	clear_error(pyrosDB);
+	pyrosDB->dirty = 1;
+	a = find_tag(pyrosDB, tag1);
+	b = find_tag(pyrosDB, tag2);
+	if (a == NO_ID || b == NO_ID)
+		return PYROS_OK;
+
+	ids_remove(&pyrosDB->tags[a].aliases, b);
+	ids_remove(&pyrosDB->tags[b].aliases, a);
+	ids_remove(&pyrosDB->tags[a].parents, b);
+	ids_remove(&pyrosDB->tags[b].parents, a);
+	ids_remove(&pyrosDB->tags[a].children, b);
+	ids_remove(&pyrosDB->tags[b].children, a);
+	return PYROS_OK;
+}
+
+enum PYROS_ERROR
+Pyros_Remove_Tag_From_Hash(PyrosDB *pyrosDB, const char *hash,
+                           const char *tag) {
+	size_t file, id;
+
+	clear_error(pyrosDB);
+	pyrosDB->dirty = 1;
+	file = find_file(pyrosDB, hash);
+	id = find_tag(pyrosDB, tag);
+	if (file != NO_ID && id != NO_ID)
+		untag_file(pyrosDB, file, id);
+	return PYROS_OK;
+}
+
+enum PYROS_ERROR
+Pyros_Remove_File(PyrosDB *pyrosDB, PyrosFile *pFile) {
+	size_t file;
+
+	clear_error(pyrosDB);
+	pyrosDB->dirty = 1;
+	if ((file = find_file(pyrosDB, pFile->hash)) != NO_ID)
+		remove_file(pyrosDB, file);
+	return PYROS_OK;
+}
+
+enum PYROS_ERROR
+Pyros_Remove_Dead_Tags(PyrosDB *pyrosDB) {
+	int removed = 0;
+
+	clear_error(pyrosDB);
+	pyrosDB->dirty = 1;
+	for (size_t i = 0; i < pyrosDB->tag_count; i++) {
+		struct MemTag *tag = &pyrosDB->tags[i];
+		if (tag->name == NULL || tag->files.length > 0 ||
+		    tag->parents.length > 0 || tag->children.length > 0 ||
+		    tag->aliases.length > 0)
+			continue;
+
+		free(tag->name);
+		tag->name = NULL;
+		removed = 1;
+	}
+
+	if (removed)
+		map_rebuild(&pyrosDB->tag_map, pyrosDB->tag_count, &tag_name,
+		            pyrosDB);
+	return PYROS_OK;
+}
@@ -0,0 +1,437 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <pyros.h>
+
+#include "cache.h"
+#include "pyros_cli.h"
+
+#define CACHE_DIR "cache"
+#define GENERATION_NAME "pyros.generation"
+#define CACHE_MAGIC "PYRQC01"
+
+/* a cache file is the header, the key padded to 8 bytes, an offset for
+ * every result and then "hash\0path\0" for every result */
+struct CacheHeader {
+	char magic[8];
+	struct CacheStamp stamp;
+	uint64_t key_length;
+	uint64_t count;
+	uint64_t data_length;
+};
+
+struct QueryCache {
+	char *path;
+	char *key;
+	size_t key_length;
+	struct CacheStamp stamp;
+
+	void *map;
+	size_t map_length;
+	const uint64_t *offsets;
+	size_t count;
+	const char *data;
+	size_t data_length;
+	int hit;
+};
+
+extern const char *ExecName;
+
+static char *
+join_path(const char *dir, const char *name) {
+	size_t len = strlen(dir);
+	char *path = malloc(len + strlen(name) + 2);
+	if (path == NULL) {
+		ERROR(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	strcpy(path, dir);
+	if (len == 0 || path[len - 1] != '/')
+		strcat(path, "/");
+	strcat(path, name);
+	return path;
+}
+
+static size_t
+pad(size_t length) {
+	return (length + 7) & ~(size_t)7;
+}
+
+static uint64_t
+read_generation(const char *db_path) {
+	char *path = join_path(db_path, GENERATION_NAME);
+	uint64_t generation = 0;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	free(path);
+	if (fd < 0)
+		return 0;
+	if (pread(fd, &generation, sizeof(generation), 0) !=
+	    sizeof(generation))
+		generation = 0;
+	close(fd);
+	return generation;
+}
+
+/* query caches are named after the 16 hex digit hash of their key, ones
+ * that were being written when a process died still carry a suffix */
+static int
+is_query_cache_name(const char *name) {
+	int i;
+
+	for (i = 0; i < 16; i++)
+		if (!isxdigit((unsigned char)name[i]))
+			return FALSE;
+	return name[i] == '\0' || name[i] == '.';
+}
+
+/* every query cache is stale once the generation moves on, removing them
+ * keeps the directory from growing with every distinct query */
+static void
+remove_query_caches(const char *db_path) {
+	char *dir = join_path(db_path, CACHE_DIR);
+	struct dirent *entry;
+	DIR *dirp = opendir(dir);
+
+	free(dir);
+	if (dirp == NULL)
+		return;
+
+	while ((entry = readdir(dirp)) != NULL) {
+		if (is_query_cache_name(entry->d_name))
+			unlinkat(dirfd(dirp), entry->d_name, 0);
+	}
+	closedir(dirp);
+}
+
+/* bumped after every commit made through the cli, the database
+ * directory's mtime catches writers that do not go through it */
+void
+BumpCacheGeneration(const char *db_path) {
+	char *path = join_path(db_path, GENERATION_NAME);
+	uint64_t generation = 0;
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+	free(path);
+	if (fd < 0 || flock(fd, LOCK_EX)) {
+		ERROR(stderr, "unable to invalidate query cache: %s\n",
+		      strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	if (pread(fd, &generation, sizeof(generation), 0) !=
+	    sizeof(generation))
+		generation = 0;
+	generation++;
+	if (pwrite(fd, &generation, sizeof(generation), 0) !=
+	    sizeof(generation)) {
+		ERROR(stderr, "unable to invalidate query cache: %s\n",
+		      strerror(errno));
+	}
+	close(fd);
+
+	remove_query_caches(db_path);
+}
+
+static int
+compare_args(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* tags are and'ed together, so their order and repeats don't matter */
+static void
+build_key(QueryCache *cache, const char *kind, int argc, char **argv) {
+	char **sorted = malloc(sizeof(*sorted) * (argc + 1));
+	size_t length = strlen(kind) + 1;
+	char *ptr;
+	int i;
+
+	if (sorted == NULL) {
+		ERROR(stderr, "Out of memory\n");
+		exit(1);
+	}
+	memcpy(sorted, argv, sizeof(*sorted) * argc);
+	qsort(sorted, argc, sizeof(*sorted), &compare_args);
+
+	for (i = 0; i < argc; i++)
+		length += strlen(sorted[i]) + 1;
+
+	if ((cache->key = malloc(length)) == NULL) {
+		ERROR(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	ptr = stpcpy(cache->key, kind) + 1;
+	for (i = 0; i < argc; i++) {
+		if (i > 0 && !strcmp(sorted[i], sorted[i - 1]))
+			continue;
+		ptr = stpcpy(ptr, sorted[i]) + 1;
+	}
+	cache->key_length = ptr - cache->key;
+	free(sorted);
+}
+
+static uint64_t
+hash_key(const char *key, size_t length) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < length; i++) {
+		hash ^= (unsigned char)key[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/* maps path if it is at least min_length bytes and starts with magic
+ * followed by stamp, min_length has to cover both. a NULL stamp accepts
+ * whatever stamp the file has */
+void *
+MapCacheFile(const char *path, const char *magic,
+             const struct CacheStamp *stamp, size_t min_length,
+             size_t *length) {
+	struct stat st;
+	void *map;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) || (size_t)st.st_size < min_length) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	if (strncmp(map, magic, 8) ||
+	    (stamp != NULL && memcmp((char *)map + 8, stamp, sizeof(*stamp)))) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	*length = st.st_size;
+	return map;
+}
+
+static void
+map_cache(QueryCache *cache) {
+	const struct CacheHeader *header;
+	size_t offsets_start, data_start;
+	uint64_t i;
+
+	cache->map = MapCacheFile(cache->path, CACHE_MAGIC, &cache->stamp,
+	                          sizeof(*header), &cache->map_length);
+	if (cache->map == NULL)
+		return;
+
+	header = cache->map;
+	if (header->key_length != cache->key_length)
+		return;
+
+	offsets_start = sizeof(*header) + pad(cache->key_length);
+	if (header->count > (cache->map_length - sizeof(*header)) / 8)
+		return;
+	data_start = offsets_start + header->count * sizeof(uint64_t);
+	if (data_start > cache->map_length ||
+	    header->data_length != cache->map_length - data_start ||
+	    memcmp((char *)cache->map + sizeof(*header), cache->key,
+	           cache->key_length))
+		return;
+
+	cache->offsets = (const uint64_t *)((char *)cache->map + offsets_start);
+	cache->data = (const char *)cache->map + data_start;
+	cache->data_length = header->data_length;
+	if (cache->data_length > 0 && cache->data[cache->data_length - 1])
+		return;
+	for (i = 0; i < header->count; i++) {
+		if (cache->offsets[i] >= cache->data_length)
+			return;
+	}
+
+	cache->count = header->count;
+	cache->hit = TRUE;
+}
+
+/* returns the path of name inside the cache directory and fills in the
+ * current stamp, or NULL when the database directory can't hold a cache */
+char *
+GetCacheStamp(const char *db_path, const char *name,
+              struct CacheStamp *stamp) {
+	char *dir = join_path(db_path, CACHE_DIR);
+	char *path;
+	struct stat st;
+
+	/* create the cache directory before taking the stamp as creating it
+	 * changes db_path's mtime */
+	if ((mkdir(dir, 0700) && errno != EEXIST) || stat(db_path, &st)) {
+		free(dir);
+		return NULL;
+	}
+
+	memset(stamp, 0, sizeof(*stamp));
+	stamp->generation = read_generation(db_path);
+	stamp->dir_sec = st.st_mtim.tv_sec;
+	stamp->dir_nsec = st.st_mtim.tv_nsec;
+
+	path = join_path(dir, name);
+	free(dir);
+	return path;
+}
+
+/* callers write to the returned file and hand it to FinishCacheFile,
+ * readers only ever see complete files */
+FILE *
+CreateCacheFile(const char *path, char **tmp) {
+	FILE *fp;
+	int fd;
+
+	if ((*tmp = malloc(strlen(path) + 8)) == NULL) {
+		ERROR(stderr, "Out of memory\n");
+		exit(1);
+	}
+	sprintf(*tmp, "%s.XXXXXX", path);
+
+	if ((fd = mkstemp(*tmp)) < 0 || (fp = fdopen(fd, "w")) == NULL) {
+		if (fd >= 0) {
+			close(fd);
+			unlink(*tmp);
+		}
+		free(*tmp);
+		return NULL;
+	}
+	return fp;
+}
+
+void
+FinishCacheFile(FILE *fp, char *tmp, const char *path) {
+	int failed = ferror(fp);
+
+	if (fclose(fp) || failed || rename(tmp, path))
+		unlink(tmp);
+	free(tmp);
+}
+
+/* returns NULL when the database directory can't hold a cache, callers
+ * then just run the query */
+QueryCache *
+OpenQueryCache(const char *db_path, const char *kind, int argc, char **argv) {
+	QueryCache *cache;
+	struct CacheStamp stamp;
+	char name[17];
+	char *dir;
+
+	if ((dir = GetCacheStamp(db_path, "", &stamp)) == NULL)
+		return NULL;
+
+	if ((cache = calloc(1, sizeof(*cache))) == NULL) {
+		ERROR(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	cache->stamp = stamp;
+	build_key(cache, kind, argc, argv);
+	snprintf(name, sizeof(name), "%016llx",
+	         (unsigned long long)hash_key(cache->key, cache->key_length));
+	cache->path = join_path(dir, name);
+	free(dir);
+
+	map_cache(cache);
+	return cache;
+}
+
+int
+CacheHit(QueryCache *cache) {
+	return cache != NULL && cache->hit;
+}
+
+size_t
+CachedLength(QueryCache *cache) {
+	return cache->count;
+}
+
+const char *
+CachedHash(QueryCache *cache, size_t index) {
+	return &cache->data[cache->offsets[index]];
+}
+
+const char *
+CachedPath(QueryCache *cache, size_t index) {
+	const char *hash = CachedHash(cache, index);
+	const char *path = hash + strlen(hash) + 1;
+
+	/* only a damaged file can end after a hash */
+	if (path >= &cache->data[cache->data_length])
+		return &cache->data[cache->data_length - 1];
+	return path;
+}
+
+/* best effort, a cache that can't be written is just skipped */
+void
+StoreQueryCache(QueryCache *cache, PyrosList *files) {
+	static const char zeros[8];
+	struct CacheHeader header;
+	PyrosFile **pFile = (PyrosFile **)files->list;
+	char *tmp;
+	uint64_t offset = 0;
+	size_t i;
+	FILE *fp;
+
+	if (cache == NULL)
+		return;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	header.stamp = cache->stamp;
+	header.key_length = cache->key_length;
+	header.count = files->length;
+	for (i = 0; i < files->length; i++)
+		offset += strlen(pFile[i]->hash) + strlen(pFile[i]->path) + 2;
+	header.data_length = offset;
+
+	if ((fp = CreateCacheFile(cache->path, &tmp)) == NULL)
+		return;
+
+	fwrite(&header, sizeof(header), 1, fp);
+	fwrite(cache->key, 1, cache->key_length, fp);
+	fwrite(zeros, 1, pad(cache->key_length) - cache->key_length, fp);
+	for (offset = 0, i = 0; i < files->length; i++) {
+		fwrite(&offset, sizeof(offset), 1, fp);
+		offset += strlen(pFile[i]->hash) + strlen(pFile[i]->path) + 2;
+	}
+	for (i = 0; i < files->length; i++) {
+		fwrite(pFile[i]->hash, 1, strlen(pFile[i]->hash) + 1, fp);
+		fwrite(pFile[i]->path, 1, strlen(pFile[i]->path) + 1, fp);
+	}
+
+	FinishCacheFile(fp, tmp, cache->path);
+}
+
+void
+CloseQueryCache(QueryCache *cache) {
+	if (cache == NULL)
+		return;
+
+	if (cache->map != NULL)
+		munmap(cache->map, cache->map_length);
+	free(cache->path);
+	free(cache->key);
+	free(cache);
+}
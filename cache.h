@@ -0,0 +1,40 @@
+#ifndef PYROS_CLI_CACHE_H
+#define PYROS_CLI_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <pyros.h>
+
+/* what a cache file was built from, it is stale once this changes */
+struct CacheStamp {
+	uint64_t generation;
+	int64_t dir_sec;
+	int64_t dir_nsec;
+};
+
+typedef struct QueryCache QueryCache;
+
+char *GetCacheStamp(const char *db_path, const char *name,
+                    struct CacheStamp *stamp);
+void *MapCacheFile(const char *path, const char *magic,
+                   const struct CacheStamp *stamp, size_t min_length,
+                   size_t *length);
+FILE *CreateCacheFile(const char *path, char **tmp);
+void FinishCacheFile(FILE *fp, char *tmp, const char *path);
+
+QueryCache *OpenQueryCache(const char *db_path, const char *kind, int argc,
+                           char **argv);
+
+int CacheHit(QueryCache *cache);
+size_t CachedLength(QueryCache *cache);
+const char *CachedHash(QueryCache *cache, size_t index);
+const char *CachedPath(QueryCache *cache, size_t index);
+
+void StoreQueryCache(QueryCache *cache, PyrosList *files);
+void CloseQueryCache(QueryCache *cache);
+
+void BumpCacheGeneration(const char *db_path);
+
+#endif
@@ -1,14 +1,28 @@
+#define _GNU_SOURCE
+
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/ioctl.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <pyros.h>
 
+#include "cache.h"
+#include "daemon.h"
+#include "export.h"
 #include "files.h"
+#include "hash.h"
+#include "input.h"
+#include "output.h"
+#include "progress.h"
 #include "pyros_cli.h"
+#include "stats.h"
+#include "tagindex.h"
 #include "tagtree.h"
 
 #define DECLARE(x) static void x(int argc, char **argv)
@@ -16,10 +30,19 @@
 	ERROR(stderr, "%s\n", Pyros_Get_Error_Message(pyrosDB));               \
 	exit(1);
 #define CHECK_ERROR(x)                                                         \
-	if (x != PYROS_OK) {                                                   \
+	if ((StatsAdd(STATS_DB_CALLS, 1), x) != PYROS_OK) {                    \
+		Pyros_Rollback(pyrosDB);                                       \
+		SHOW_ERROR_AND_EXIT;                                           \
+	}
+/* the error a query that returned NULL left behind, the query was already
+ * counted */
+#define CHECK_QUERY_ERROR()                                                    \
+	if (Pyros_Get_Error_Type(pyrosDB) != PYROS_OK) {                       \
 		Pyros_Rollback(pyrosDB);                                       \
 		SHOW_ERROR_AND_EXIT;                                           \
 	}
+/* times a read from the database and counts it as a database call */
+#define QUERY(x) (StatsStart(STATS_QUERY), query_done(x))
 
 DECLARE(create);
 DECLARE(help);
@@ -28,6 +51,8 @@ DECLARE(add);
 DECLARE(search);
 DECLARE(list_hash);
 DECLARE(list_tags);
+DECLARE(complete_tag);
+DECLARE(suggest_tag);
 DECLARE(get_alias);
 DECLARE(get_children);
 DECLARE(get_parents);
@@ -44,10 +69,22 @@ DECLARE(prune_tags);
 DECLARE(add_tag);
 DECLARE(vacuum);
 DECLARE(export);
+DECLARE(batch);
+DECLARE(import_relations);
+DECLARE(tag_batch);
+DECLARE(serve);
 
 extern char *PDB_PATH;
 extern const char *ExecName;
 extern int flags;
+extern char *jobs_arg;
+extern char *link_arg;
+extern char *commit_arg;
+extern char *format_arg;
+extern char *manifest_arg;
+extern char *limit_arg;
+extern char *offset_arg;
+extern ArgReader *input_reader;
 extern struct Flag gflags[];
 extern size_t gflags_len;
 
@@ -84,7 +121,8 @@ const struct Cmd commands[] = {
 		"add", "a"
 		,&add,
 		1,-1,
-		CMD_RECURSIVE_FLAG | CMD_INPUT_FLAG | CMD_PROGRESS_FLAG,
+		CMD_RECURSIVE_FLAG | CMD_INPUT_FLAG | CMD_NUL_FLAG |
+		CMD_PROGRESS_FLAG | CMD_JOBS_FLAG | CMD_COMMIT_FLAG,
 		"Add file(s) to database",
 		"(file | directory)... [tag]..."
 	},
@@ -92,7 +130,7 @@ const struct Cmd commands[] = {
 		"add-tag" ,"at",
 		&add_tag,
 		2,-1,
-		0,
+		CMD_WARN_FLAG,
 		"Add tag(s) to file",
 		"<hash> <tag>..."
 	},
@@ -100,7 +138,8 @@ const struct Cmd commands[] = {
 		"search" ,"s" ,
 		&search,
 		1,-1,
-		CMD_HASH_FLAG | CMD_INPUT_FLAG,
+		CMD_HASH_FLAG | CMD_INPUT_FLAG | CMD_NUL_FLAG |
+		CMD_LIMIT_FLAG | CMD_OFFSET_FLAG | CMD_COUNT_FLAG | CMD_WARN_FLAG,
 		"Search for files by tags",
 		"(tag)..."
 	},
@@ -108,7 +147,7 @@ const struct Cmd commands[] = {
 		"list-hashes" ,"lh",
 		&list_hash,
 		0 ,0,
-		0,
+		CMD_NUL_FLAG | CMD_COUNT_FLAG,
 		"List all file hashes",
 		""
 	},
@@ -116,15 +155,31 @@ const struct Cmd commands[] = {
 		"list-tags" ,"lt",
 		&list_tags,
 		0 ,0,
-		0,
+		CMD_NUL_FLAG | CMD_COUNT_FLAG,
 		"List all tags",
 		""
 	},
+	{
+		"complete-tag" ,"ct",
+		&complete_tag,
+		1 ,1,
+		CMD_NUL_FLAG | CMD_LIMIT_FLAG | CMD_FORMAT_FLAG,
+		"List tags starting with prefix",
+		"<prefix>"
+	},
+	{
+		"suggest-tag" ,"st",
+		&suggest_tag,
+		1 ,1,
+		CMD_NUL_FLAG | CMD_LIMIT_FLAG | CMD_FORMAT_FLAG,
+		"List existing tags closest to tag",
+		"<tag>"
+	},
 	{
 		"get-alias" ,"ga",
 		&get_alias,
 		1 ,1,
-		0,
+		CMD_NUL_FLAG,
 		"List aliases of a tag",
 		"(tag)"
 	},
@@ -132,7 +187,7 @@ const struct Cmd commands[] = {
 		"get-children" ,"gc",
 		&get_children,
 		1 ,1,
-		0,
+		CMD_NUL_FLAG,
 		"List children of a tag",
 		"(tag)"
 	},
@@ -140,7 +195,7 @@ const struct Cmd commands[] = {
 		"get-parents" ,"gp",
 		&get_parents,
 		1 ,1,
-		0,
+		CMD_NUL_FLAG,
 		"List parents of a tag",
 		"(tag)"
 	},
@@ -148,17 +203,17 @@ const struct Cmd commands[] = {
 		"get-tags" ,"gt",
 		&get_hash ,
 		1 ,1,
-		0,
+		CMD_NUL_FLAG,
 		"List tags associated with a file",
 		"(hash)"
 	},
 	{
 		"get-related" ,"gr",
 		&get_related,
-		1 ,1,
-		0,
-		"Recursivly list all children and aliases of a tag",
-		"(tag)"
+		1 ,-1,
+		CMD_FORMAT_FLAG | CMD_WARN_FLAG | CMD_INPUT_FLAG | CMD_NUL_FLAG,
+		"Recursivly list all children and aliases of tags",
+		"(tag)..."
 	},
 	{
 		"add-alias" ,"aa",
@@ -204,7 +259,7 @@ const struct Cmd commands[] = {
 		"remove-file" ,"rf",
 		&remove_file ,
 		1,-1,
-		CMD_INPUT_FLAG,
+		CMD_INPUT_FLAG | CMD_NUL_FLAG,
 		"Remove file(s) from database",
 		"(hash)..."
 	},
@@ -236,18 +291,75 @@ const struct Cmd commands[] = {
 		"export" ,"ex" ,
 		&export ,
 		2, -1,
-		0,
+		CMD_JOBS_FLAG | CMD_LINK_FLAG | CMD_PROGRESS_FLAG |
+		CMD_SYNC_FLAG | CMD_CHECKSUM_FLAG | CMD_DELETE_FLAG |
+		CMD_MANIFEST_FLAG,
 		"Copy files from the database to specified directory",
 		"<output_dir> <tags>..."
 	},
+	{
+		"batch" ,"b" ,
+		&batch ,
+		0, 1,
+		CMD_COMMIT_FLAG,
+		"Run commands read line by line from a file or stdin "
+		"against one open database",
+		"[file]"
+	},
+	{
+		"import-relations" ,"ir" ,
+		&import_relations ,
+		0, 1,
+		CMD_COMMIT_FLAG | CMD_PROGRESS_FLAG,
+		"Add tag relations read as TSV from a file or stdin "
+		"(tag, parent or tag, tag, alias)",
+		"[file]"
+	},
+	{
+		"tag-batch" ,"tb" ,
+		&tag_batch ,
+		0, 1,
+		CMD_COMMIT_FLAG | CMD_PROGRESS_FLAG,
+		"Add tags to files read as TSV lines of hash and tags from "
+		"a file or stdin",
+		"[file]"
+	},
+	{
+		"serve" ,"sv" ,
+		&serve ,
+		0, 0,
+		0,
+		"Keep the database open and serve commands from other "
+		"invocations over a socket",
+		""
+	},
 };
 /* clang-format on */
 
 const int command_length = LENGTH(commands);
 
+/* while a batch runs or the daemon serves a request every command shares
+ * one database handle and leaves closing it to whoever opened it, a batch
+ * also takes over committing */
+static PyrosDB *shared_db = NULL;
+static int defer_commit = FALSE;
+static int in_batch = FALSE;
+static int serving = FALSE;
+
+static void *
+query_done(void *result) {
+	StatsStop(STATS_QUERY);
+	StatsAdd(STATS_DB_CALLS, 1);
+	return result;
+}
+
 static PyrosDB *
 open_db(char *path) {
 	PyrosDB *pyrosDB;
+
+	if (shared_db != NULL)
+		return shared_db;
+
 	if (!Pyros_Database_Exists(path)) {
 		ERROR(
 		    stderr,
@@ -261,20 +373,34 @@ open_db(char *path) {
 		exit(1);
 	}
 
+	StatsStart(STATS_OPEN);
+	StatsAdd(STATS_DB_CALLS, 1);
 	if (Pyros_Open_Database(pyrosDB) != PYROS_OK) {
 		ERROR(stderr, "Unable to open database: %s\n",
 		      Pyros_Get_Error_Message(pyrosDB));
 		exit(1);
 	}
+	StatsStop(STATS_OPEN);
 	return pyrosDB;
 }
 
 static void
-commit(PyrosDB *pyrosDB) {
+commit_now(PyrosDB *pyrosDB) {
+	StatsStart(STATS_COMMIT);
 	CHECK_ERROR(Pyros_Commit(pyrosDB))
+	BumpCacheGeneration(PDB_PATH);
+	StatsStop(STATS_COMMIT);
+}
+
+static void
+commit(PyrosDB *pyrosDB) {
+	if (!defer_commit)
+		commit_now(pyrosDB);
 }
 static void
 close_db(PyrosDB *pyrosDB) {
+	if (shared_db != NULL)
+		return;
 	CHECK_ERROR(Pyros_Close_Database(pyrosDB))
 }
 static void
@@ -303,31 +429,125 @@ forEachChild(int argc, char **argv, foreach func) {
 	close_db(pyrosDB);
 }
 
+static size_t
+get_number_arg(const char *arg, const char *name) {
+	unsigned long value;
+	char *end;
+
+	errno = 0;
+	value = strtoul(arg, &end, 10);
+	if (!isdigit((unsigned char)arg[0]) || *end != '\0' || errno ||
+	    value == 0) {
+		ERROR(stderr, "invalid %s \"%s\"\n", name, arg);
+		exit(1);
+	}
+	return value;
+}
+
+/* more workers than this only add contention, larger counts are clamped
+ * so they can't overflow the sizes derived from them */
+#define MAX_JOBS 256
+
+static int
+get_jobs_arg() {
+	size_t jobs = get_number_arg(jobs_arg, "job count");
+
+	return jobs > MAX_JOBS ? MAX_JOBS : (int)jobs;
+}
+
+static size_t
+get_size_arg(const char *arg, const char *name) {
+	unsigned long long value;
+	char *end;
+
+	errno = 0;
+	value = strtoull(arg, &end, 10);
+	if (!isdigit((unsigned char)arg[0]) || *end != '\0' || errno ||
+	    value > SIZE_MAX) {
+		ERROR(stderr, "invalid %s \"%s\"\n", name, arg);
+		exit(1);
+	}
+	return value;
+}
+
+static OutputWriter *
+open_output() {
+	return NewOutputWriter(STDOUT_FILENO,
+	                       (flags & CMD_NUL_FLAG) ? '\0' : '\n');
+}
+
+/* a limit of 0 selects everything after offset, it only happens without
+ * -L since get_number_arg rejects "-L 0" for every command */
+static size_t
+slice_end(size_t length, size_t *offset, size_t limit) {
+	if (*offset > length)
+		*offset = length;
+	if (limit != 0 && limit < length - *offset)
+		return *offset + limit;
+	return length;
+}
+
 static void
-PrintFileList(PyrosList *pList) {
+PrintFileList(PyrosList *pList, size_t offset, size_t limit) {
 	PyrosFile **pFile = (PyrosFile **)pList->list;
-	while (*pFile) {
+	size_t end = slice_end(pList->length, &offset, limit);
+	OutputWriter *out = open_output();
+
+	for (; offset < end; offset++) {
 		if (flags & CMD_HASH_FLAG)
-			printf("%s\n", (*pFile)->hash);
+			WriteRow(out, pFile[offset]->hash);
 		else
-			printf("%s\n", (*pFile)->path);
-		pFile++;
+			WriteRow(out, pFile[offset]->path);
 	}
+	CloseOutputWriter(out);
 	Pyros_List_Free(pList, (Pyros_Free_Callback)Pyros_Free_File);
 }
 
+static void
+PrintCachedList(QueryCache *cache, size_t offset, size_t limit) {
+	size_t end = slice_end(CachedLength(cache), &offset, limit);
+	OutputWriter *out = open_output();
+
+	for (; offset < end; offset++) {
+		if (flags & CMD_HASH_FLAG)
+			WriteRow(out, CachedHash(cache, offset));
+		else
+			WriteRow(out, CachedPath(cache, offset));
+	}
+	CloseOutputWriter(out);
+}
+
+static void
+write_count(size_t length) {
+	OutputWriter *out = open_output();
+	char count[32];
+
+	snprintf(count, sizeof(count), "%zu", length);
+	WriteRow(out, count);
+	CloseOutputWriter(out);
+}
+
+static void
+PrintCount(PyrosList *pList, Pyros_Free_Callback cb) {
+	write_count(pList->length);
+	Pyros_List_Free(pList, cb);
+}
+
 static void
 PrintList(PyrosList *pList) {
 	char **ptr;
+	OutputWriter *out;
 	/* add some sort of error */
 	if (pList == NULL)
 		return;
 
+	out = open_output();
 	ptr = (char **)pList->list;
 	while (*ptr) {
-		printf("%s\n", *ptr);
+		WriteRow(out, *ptr);
 		ptr++;
 	}
+	CloseOutputWriter(out);
 	Pyros_List_Free(pList, free);
 }
 
@@ -409,30 +629,206 @@ version(int argc, char **argv) {
 	printf("Pyros Version: %d.%d\n", PYROS_VERSION, PYROS_VERSION_MINOR);
 }
 
+/* sizes aren't known here and a stat() per file isn't worth it for the
+ * progress line, so add only counts files */
 static void
 add_progress_cb(const char *hash, const char *file, size_t position,
                 void *data) {
-	struct winsize w;
-	size_t len = *(size_t *)data;
-	double progress = position / (double)len;
-	double prog_bar_size;
-
 	UNUSED(hash);
-	ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
-	prog_bar_size = w.ws_col / 2.0;
+	UNUSED(position);
+	ProgressAdvance(data, 1, 0, file);
+}
 
-	for (int i = 0; i < w.ws_col; i++)
-		putchar(' ');
+struct HashIndex {
+	const char *hash;
+	size_t index;
+};
 
-	printf("\r%s\n[", file);
-	for (int i = 0; i < prog_bar_size; i++) {
-		if (progress >= i / prog_bar_size)
-			putchar('*');
-		else
-			putchar(' ');
+static int
+cmp_hash_index(const void *a, const void *b) {
+	const struct HashIndex *x = a, *y = b;
+	int cmp = strcmp(x->hash, y->hash);
+
+	if (cmp != 0)
+		return cmp;
+	return (x->index > y->index) - (x->index < y->index);
+}
+
+static int
+has_tag_file(const char *path) {
+	char tag_file[strlen(path) + 5];
+
+	strcpy(tag_file, path);
+	strcat(tag_file, ".txt");
+	return pathExists(tag_file);
+}
+
+/* hash files on several threads up front and only leave the ones the
+ * database doesn't know yet for Pyros_Add_Full, files with a tag file next
+ * to them are kept so it still gets read */
+static void
+drop_known_files(PyrosDB *pyrosDB, PyrosList *files, PyrosList *tags,
+                 int jobs) {
+	char **hashes;
+	struct HashIndex *sorted = malloc(sizeof(*sorted) * files->length);
+	char *drop = calloc(files->length, 1);
+	size_t count = files->length;
+	size_t sorted_count = 0;
+	size_t kept = 0;
+	size_t i;
+	PyrosFile *pFile;
+
+	if (sorted == NULL || drop == NULL) {
+		ERROR(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	StatsStart(STATS_HASH);
+	hashes = hashFiles(files, Pyros_Get_Hash_Type(pyrosDB), jobs);
+	StatsStop(STATS_HASH);
+
+	for (i = 0; i < count; i++) {
+		if (hashes[i] == NULL || has_tag_file(files->list[i]))
+			continue;
+		sorted[sorted_count].hash = hashes[i];
+		sorted[sorted_count].index = i;
+		sorted_count++;
 	}
-	printf("] %d%%\r", (int)(progress * 100));
-	fflush(stdout);
+
+	qsort(sorted, sorted_count, sizeof(*sorted), &cmp_hash_index);
+
+	for (i = 0; i < sorted_count; i++) {
+		if (i > 0 && !strcmp(sorted[i].hash, sorted[i - 1].hash)) {
+			drop[sorted[i].index] = TRUE;
+			continue;
+		}
+
+		pFile = QUERY(
+		    Pyros_Get_File_From_Hash(pyrosDB, sorted[i].hash));
+		if (pFile == NULL) {
+			CHECK_QUERY_ERROR();
+			continue;
+		}
+		Pyros_Free_File(pFile);
+
+		if (tags->length > 0)
+			CHECK_ERROR(Pyros_Add_Tag(pyrosDB, sorted[i].hash,
+			                          (const char **)tags->list,
+			                          tags->length));
+		drop[sorted[i].index] = TRUE;
+	}
+
+	for (i = 0; i < count; i++)
+		if (!drop[i])
+			files->list[kept++] = files->list[i];
+	files->length = kept;
+	files->list[kept] = NULL;
+
+	freeHashes(hashes, count);
+	free(sorted);
+	free(drop);
+}
+
+static void
+add_files(PyrosDB *pyrosDB, char **files, size_t count, PyrosList *tags,
+          Progress *progress) {
+	StatsStart(STATS_IMPORT);
+	StatsAdd(STATS_FILES, count);
+	if (count == 0) {
+		/* everything was already in the database */
+	} else if (progress != NULL) {
+		CHECK_ERROR(Pyros_Add_Full(
+		    pyrosDB, (const char **)files, count,
+		    (const char **)tags->list, tags->length, TRUE, FALSE,
+		    &add_progress_cb, progress));
+	} else {
+		CHECK_ERROR(Pyros_Add_Full(pyrosDB, (const char **)files, count,
+		                           (const char **)tags->list,
+		                           tags->length, TRUE, FALSE, NULL, NULL));
+	}
+	StatsStop(STATS_IMPORT);
+}
+
+/* imports files in batches of batch_size with a commit after each one */
+static void
+add_batches(PyrosDB *pyrosDB, PyrosList *files, PyrosList *tags,
+            size_t batch_size, Progress *progress) {
+	size_t i = 0;
+	size_t count;
+
+	/* commit even when there is nothing left to add, tags may have been
+	 * added to files already in the database */
+	do {
+		count = files->length - i;
+		if (count > batch_size)
+			count = batch_size;
+
+		add_files(pyrosDB, (char **)&files->list[i], count, tags,
+		          progress);
+		commit(pyrosDB);
+		i += count;
+	} while (i < files->length);
+}
+
+/* imports files named on stdin batch_size at a time, committing after each
+ * batch so memory stays flat and a failure only loses the current batch.
+ * Tags can only come from the command line since they have to be known
+ * before the first batch is imported */
+static void
+add_stream(PyrosDB *pyrosDB, PyrosList *tags, PyrosList *files,
+           PyrosList *dirs, size_t batch_size, Progress *progress) {
+	PyrosList *walked = Pyros_Create_List(batch_size);
+	PyrosList *missing = Pyros_Create_List(1);
+	size_t read_count;
+	size_t root_dirs;
+	size_t i;
+
+	if (walked == NULL || missing == NULL) {
+		ERROR(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	do {
+		StatsStart(STATS_INPUT);
+		read_count = ReadArgs(input_reader, batch_size);
+		StatsStop(STATS_INPUT);
+		getFilesFromArgs(missing, files, dirs, read_count,
+		                 GetArgs(input_reader));
+
+		for (i = 0; i < missing->length; i++) {
+			if (progress != NULL)
+				ProgressClear(progress);
+			ERROR(stderr, "skipping \"%s\": no such file\n",
+			      (char *)missing->list[i]);
+		}
+
+		root_dirs = dirs->length;
+		StatsStart(STATS_WALK);
+		getDirContents(walked, dirs, flags & CMD_RECURSIVE_FLAG);
+		StatsStop(STATS_WALK);
+		for (i = 0; i < walked->length; i++)
+			if (Pyros_List_Append(files, walked->list[i]) !=
+			    PYROS_OK) {
+				ERROR(stderr, "Out of memory\n");
+				exit(1);
+			}
+
+		if (flags & CMD_JOBS_FLAG)
+			drop_known_files(pyrosDB, files, tags, get_jobs_arg());
+
+		add_batches(pyrosDB, files, tags, batch_size, progress);
+
+		for (i = root_dirs; i < dirs->length; i++)
+			free(dirs->list[i]);
+		Pyros_List_Clear(walked, &free);
+		Pyros_List_Clear(missing, NULL);
+		Pyros_List_Clear(files, NULL);
+		Pyros_List_Clear(dirs, NULL);
+		ClearArgs(input_reader);
+	} while (read_count == batch_size);
+
+	Pyros_List_Free(walked, NULL);
+	Pyros_List_Free(missing, NULL);
 }
 
 static void
@@ -441,33 +837,53 @@ add(int argc, char **argv) {
 	PyrosList *files = Pyros_Create_List(argc);
 	PyrosList *dirs = Pyros_Create_List(1);
 	PyrosDB *pyrosDB = open_db(PDB_PATH);
+	Progress *progress = NULL;
+	size_t batch_size = 0;
 
 	if (tags == NULL || files == NULL || dirs == NULL) {
 		ERROR(stderr, "Out of memory\n");
 		exit(1);
 	}
 
+	if (flags & CMD_COMMIT_FLAG)
+		batch_size = get_number_arg(commit_arg, "batch size");
+
 	getFilesFromArgs(tags, files, dirs, argc, argv);
+
+	if (input_reader != NULL) {
+		/* the total is not known up front when streaming */
+		if (flags & CMD_PROGRESS_FLAG)
+			progress = NewProgress(0);
+		add_stream(pyrosDB, tags, files, dirs, batch_size, progress);
+		goto done;
+	}
+
+	StatsStart(STATS_WALK);
 	getDirContents(files, dirs, flags & CMD_RECURSIVE_FLAG);
+	StatsStop(STATS_WALK);
 
 	if (files->length == 0) {
 		ERROR(stderr, "no valid files given\n");
 		exit(1);
 	}
 
-	if (flags & CMD_PROGRESS_FLAG) {
-		CHECK_ERROR(Pyros_Add_Full(
-		    pyrosDB, (const char **)files->list, files->length,
-		    (const char **)tags->list, tags->length, TRUE, FALSE,
-		    &add_progress_cb, &files->length));
+	if (flags & CMD_JOBS_FLAG)
+		drop_known_files(pyrosDB, files, tags, get_jobs_arg());
+
+	if (flags & CMD_PROGRESS_FLAG)
+		progress = NewProgress(files->length);
+
+	if (batch_size == 0) {
+		add_files(pyrosDB, (char **)files->list, files->length, tags,
+		          progress);
+		commit(pyrosDB);
 	} else {
-		CHECK_ERROR(
-		    Pyros_Add_Full(pyrosDB, (const char **)files->list,
-		                   files->length, (const char **)tags->list,
-		                   tags->length, TRUE, FALSE, NULL, NULL));
+		add_batches(pyrosDB, files, tags, batch_size, progress);
 	}
 
-	commit(pyrosDB);
+done:
+	if (progress != NULL)
+		FinishProgress(progress);
 	Pyros_List_Free(tags, NULL);
 	Pyros_List_Free(files, NULL);
 	Pyros_List_Free(dirs, NULL);
@@ -489,17 +905,144 @@ add_child(int argc, char **argv) {
 	forEachChild(argc, argv, &Pyros_Add_Parent);
 }
 
+/* the tag index in the database's cache directory, rebuilt first if the
+ * database changed, pyrosDB is opened only for that if it is NULL */
+static TagIndex *
+load_tag_index(PyrosDB *pyrosDB) {
+	TagIndex *index;
+	int opened = FALSE;
+
+	if ((index = OpenTagIndex(PDB_PATH)) != NULL)
+		return index;
+
+	if (pyrosDB == NULL) {
+		pyrosDB = open_db(PDB_PATH);
+		opened = TRUE;
+	}
+	if ((index = BuildTagIndex(PDB_PATH, pyrosDB)) == NULL) {
+		CHECK_QUERY_ERROR();
+	}
+	if (opened)
+		close_db(pyrosDB);
+	return index;
+}
+
+/* tsv is the only format tag lists have besides the plain one */
+static int
+get_tsv_format() {
+	if (!(flags & CMD_FORMAT_FLAG))
+		return FALSE;
+
+	if (strcmp(format_arg, "tsv")) {
+		ERROR(stderr, "Unknown format \"%s\".\n", format_arg);
+		exit(1);
+	}
+	return TRUE;
+}
+
+/* whether tag exists, for the few tags a stale index doesn't know */
+static int
+tag_exists(PyrosDB *pyrosDB, const char *tag) {
+	PyrosList *related;
+	int exists;
+
+	related = QUERY(Pyros_Get_Related_Tags(pyrosDB, tag, PYROS_ALIAS));
+	if (related == NULL) {
+		CHECK_QUERY_ERROR();
+		return FALSE;
+	}
+	exists = related->length > 0;
+	Pyros_List_Free(related, (Pyros_Free_Callback)Pyros_Free_Tag);
+	return exists;
+}
+
+/* with -w, tags that don't exist get a warning naming the closest ones,
+ * negated and wildcard search terms are checked without the '-' and
+ * skipped respectively.
+ * every commit leaves the index stale and rebuilding it costs far more
+ * than a warning is worth, so a stale one is used as it is: tags it knows
+ * are taken as known, the others are looked up in the database and only
+ * suggestions can miss tags added since */
+static void
+warn_unknown_tags(PyrosDB **pyrosDB, char **tags, int count, int search) {
+	struct TagSuggestion suggestions[3];
+	TagIndex *index;
+	const char *tag;
+	size_t found, j;
+	int stale = FALSE;
+	int i;
+
+	if (!(flags & CMD_WARN_FLAG))
+		return;
+
+	if ((index = OpenStaleTagIndex(PDB_PATH, &stale)) == NULL)
+		index = load_tag_index(*pyrosDB);
+	for (i = 0; i < count; i++) {
+		tag = tags[i];
+		if (search && tag[0] == '-')
+			tag++;
+		if ((search && strpbrk(tag, "*?:") != NULL) ||
+		    TagIndexContains(index, tag))
+			continue;
+
+		if (stale) {
+			if (*pyrosDB == NULL)
+				*pyrosDB = open_db(PDB_PATH);
+			if (tag_exists(*pyrosDB, tag))
+				continue;
+		}
+
+		found = SuggestTags(index, tag, suggestions, LENGTH(suggestions));
+		ERROR(stderr, "unknown tag \"%s\"", tag);
+		for (j = 0; j < found; j++)
+			fprintf(stderr, "%s\"%s\"", j ? ", " : ", did you mean ",
+			        TagIndexName(index, suggestions[j].tag));
+		fprintf(stderr, "%s\n", found ? "?" : "");
+	}
+	CloseTagIndex(index);
+}
+
 static void
 search(int argc, char **argv) {
-	PyrosDB *pyrosDB = open_db(PDB_PATH);
+	PyrosDB *pyrosDB = NULL;
 	PyrosList *files;
+	QueryCache *cache;
+	size_t offset = 0;
+	size_t limit = 0;
+
+	if (flags & CMD_OFFSET_FLAG)
+		offset = get_size_arg(offset_arg, "offset");
+	if (flags & CMD_LIMIT_FLAG)
+		limit = get_number_arg(limit_arg, "limit");
 
-	files = Pyros_Search(pyrosDB, (const char **)argv, argc);
+	warn_unknown_tags(&pyrosDB, argv, argc, TRUE);
+
+	cache = OpenQueryCache(PDB_PATH, "search", argc, argv);
+	if (CacheHit(cache)) {
+		if (flags & CMD_COUNT_FLAG)
+			write_count(CachedLength(cache));
+		else
+			PrintCachedList(cache, offset, limit);
+		CloseQueryCache(cache);
+		if (pyrosDB != NULL)
+			close_db(pyrosDB);
+		return;
+	}
+
+	if (pyrosDB == NULL)
+		pyrosDB = open_db(PDB_PATH);
+	files = QUERY(Pyros_Search(pyrosDB, (const char **)argv, argc));
 	if (files == NULL) {
-		CHECK_ERROR(Pyros_Get_Error_Type(pyrosDB));
+		CHECK_QUERY_ERROR();
 	}
 
-	PrintFileList(files);
+	StoreQueryCache(cache, files);
+	CloseQueryCache(cache);
+
+	if (flags & CMD_COUNT_FLAG)
+		PrintCount(files, (Pyros_Free_Callback)Pyros_Free_File);
+	else
+		PrintFileList(files, offset, limit);
 	close_db(pyrosDB);
 }
 
@@ -510,12 +1053,15 @@ list_hash(int argc, char **argv) {
 	UNUSED(argc);
 	UNUSED(argv);
 
-	list = Pyros_Get_All_Hashes(pyrosDB);
+	list = QUERY(Pyros_Get_All_Hashes(pyrosDB));
 	if (list == NULL) {
-		CHECK_ERROR(Pyros_Get_Error_Type(pyrosDB));
+		CHECK_QUERY_ERROR();
 	}
 
-	PrintList(list);
+	if (flags & CMD_COUNT_FLAG)
+		PrintCount(list, free);
+	else
+		PrintList(list);
 	close_db(pyrosDB);
 }
 
@@ -526,24 +1072,128 @@ list_tags(int argc, char **argv) {
 	UNUSED(argc);
 	UNUSED(argv);
 
-	list = Pyros_Get_All_Tags(pyrosDB);
+	list = QUERY(Pyros_Get_All_Tags(pyrosDB));
 	if (list == NULL) {
-		CHECK_ERROR(Pyros_Get_Error_Type(pyrosDB));
+		CHECK_QUERY_ERROR();
 	}
 
-	PrintList(list);
+	if (flags & CMD_COUNT_FLAG)
+		PrintCount(list, free);
+	else
+		PrintList(list);
 	close_db(pyrosDB);
 }
 
+/* aliases are symmetric in libpyros, the tag of an alias group that sorts
+ * first stands for all of them */
+static void
+write_canonical_tag(OutputWriter *out, PyrosDB *pyrosDB, const char *tag) {
+	PyrosList *related;
+	PyrosTag *alias;
+	const char *canonical = tag;
+	size_t i;
+
+	related = QUERY(Pyros_Get_Related_Tags(pyrosDB, tag, PYROS_ALIAS));
+	if (related == NULL) {
+		CHECK_QUERY_ERROR();
+		WriteTSVField(out, tag);
+		return;
+	}
+
+	for (i = 0; i < related->length; i++) {
+		alias = related->list[i];
+		if (strcmp(alias->tag, canonical) < 0)
+			canonical = alias->tag;
+	}
+	WriteTSVField(out, canonical);
+	Pyros_List_Free(related, (Pyros_Free_Callback)Pyros_Free_Tag);
+}
+
+static void
+complete_tag(int argc, char **argv) {
+	PyrosDB *pyrosDB = NULL;
+	TagIndex *index;
+	OutputWriter *out;
+	size_t i, end;
+	size_t limit = 0;
+	int tsv = get_tsv_format();
+	UNUSED(argc);
+
+	if (flags & CMD_LIMIT_FLAG)
+		limit = get_number_arg(limit_arg, "limit");
+
+	/* the index has no alias data, only the printed tags are looked up */
+	if (tsv)
+		pyrosDB = open_db(PDB_PATH);
+	index = load_tag_index(pyrosDB);
+	i = FindTagPrefix(index, argv[0], &end);
+	end = slice_end(end, &i, limit);
+
+	out = open_output();
+	for (; i < end; i++) {
+		if (tsv) {
+			/* tag and the tag it is an alias of */
+			WriteTSVField(out, TagIndexName(index, i));
+			WriteString(out, "\t");
+			write_canonical_tag(out, pyrosDB, TagIndexName(index, i));
+			WriteRow(out, "");
+		} else {
+			WriteRow(out, TagIndexName(index, i));
+		}
+	}
+	CloseOutputWriter(out);
+	CloseTagIndex(index);
+	if (pyrosDB != NULL)
+		close_db(pyrosDB);
+}
+
+static void
+suggest_tag(int argc, char **argv) {
+	struct TagSuggestion *suggestions;
+	TagIndex *index;
+	OutputWriter *out;
+	size_t i, found;
+	size_t limit = 5;
+	int tsv = get_tsv_format();
+	char score[32];
+	UNUSED(argc);
+
+	if (flags & CMD_LIMIT_FLAG)
+		limit = get_number_arg(limit_arg, "limit");
+	if ((suggestions = malloc(sizeof(*suggestions) * limit)) == NULL) {
+		ERROR(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	index = load_tag_index(NULL);
+	found = SuggestTags(index, argv[0], suggestions, limit);
+
+	out = open_output();
+	for (i = 0; i < found; i++) {
+		if (tsv) {
+			/* tag and how similar it is, 1 for an exact match */
+			WriteTSVField(out, TagIndexName(index, suggestions[i].tag));
+			sprintf(score, "\t%.3f", suggestions[i].score);
+			WriteString(out, score);
+			WriteRow(out, "");
+		} else {
+			WriteRow(out, TagIndexName(index, suggestions[i].tag));
+		}
+	}
+	CloseOutputWriter(out);
+	CloseTagIndex(index);
+	free(suggestions);
+}
+
 static void
 get_alias(int argc, char **argv) {
 	PyrosDB *pyrosDB = open_db(PDB_PATH);
 	PyrosList *list;
 	UNUSED(argc);
 
-	list = Pyros_Get_Aliases(pyrosDB, argv[0]);
+	list = QUERY(Pyros_Get_Aliases(pyrosDB, argv[0]));
 	if (list == NULL) {
-		CHECK_ERROR(Pyros_Get_Error_Type(pyrosDB));
+		CHECK_QUERY_ERROR();
 	}
 
 	PrintList(list);
@@ -556,9 +1206,9 @@ get_children(int argc, char **argv) {
 	PyrosList *list;
 	UNUSED(argc);
 
-	list = Pyros_Get_Children(pyrosDB, argv[0]);
+	list = QUERY(Pyros_Get_Children(pyrosDB, argv[0]));
 	if (list == NULL) {
-		CHECK_ERROR(Pyros_Get_Error_Type(pyrosDB));
+		CHECK_QUERY_ERROR();
 	}
 
 	PrintList(list);
@@ -571,9 +1221,9 @@ get_parents(int argc, char **argv) {
 	PyrosList *list;
 	UNUSED(argc);
 
-	list = Pyros_Get_Parents(pyrosDB, argv[0]);
+	list = QUERY(Pyros_Get_Parents(pyrosDB, argv[0]));
 	if (list == NULL) {
-		CHECK_ERROR(Pyros_Get_Error_Type(pyrosDB));
+		CHECK_QUERY_ERROR();
 	}
 
 	PrintList(list);
@@ -586,32 +1236,64 @@ get_hash(int argc, char **argv) {
 	PyrosList *tags;
 	UNUSED(argc);
 
-	tags = Pyros_Get_Tags_From_Hash_Simple(pyrosDB, argv[0], TRUE);
+	tags = QUERY(Pyros_Get_Tags_From_Hash_Simple(pyrosDB, argv[0], TRUE));
 	if (tags == NULL) {
-		CHECK_ERROR(Pyros_Get_Error_Type(pyrosDB));
+		CHECK_QUERY_ERROR();
 	}
 
 	PrintList(tags);
 	close_db(pyrosDB);
 }
 
+static enum TREE_FORMAT
+get_tree_format(const char *arg) {
+	if (!strcmp(arg, "tree"))
+		return TREE_FORMAT_TREE;
+	else if (!strcmp(arg, "json"))
+		return TREE_FORMAT_JSON;
+	else if (!strcmp(arg, "dot"))
+		return TREE_FORMAT_DOT;
+	else if (!strcmp(arg, "tsv"))
+		return TREE_FORMAT_TSV;
+
+	ERROR(stderr, "Unknown format \"%s\".\n", arg);
+	exit(1);
+}
+
+/* several roots are printed as one forest, a root already expanded under
+ * an earlier one isn't queried again */
 static void
 get_related(int argc, char **argv) {
 	PyrosList *tags;
 	PyrosDB *pyrosDB = open_db(PDB_PATH);
+	TagForest *forest = NewTagForest();
 	TagTree *tree;
+	enum TREE_FORMAT format = TREE_FORMAT_TREE;
+	int i;
 
-	UNUSED(argc);
-	tags =
-	    Pyros_Get_Related_Tags(pyrosDB, argv[0], PYROS_SEARCH_RELATIONSHIP);
+	if (flags & CMD_FORMAT_FLAG)
+		format = get_tree_format(format_arg);
+	warn_unknown_tags(&pyrosDB, argv, argc, FALSE);
 
-	CHECK_ERROR(Pyros_Get_Error_Type(pyrosDB));
+	for (i = 0; i < argc; i++) {
+		if (ForestHasTag(forest, argv[i])) {
+			AddSharedRoot(forest, argv[i]);
+			continue;
+		}
+
+		tags = QUERY(Pyros_Get_Related_Tags(pyrosDB, argv[i],
+		                                    PYROS_SEARCH_RELATIONSHIP));
+		if (tags == NULL) {
+			CHECK_QUERY_ERROR();
+		}
+		MergeRelated(forest, tags);
+	}
 
-	tree = PyrosTagToTree((PyrosTag **)tags->list, tags->length);
-	PrintTree(tree);
+	tree = ForestToTree(forest);
+	PrintTree(tree, format);
 	DestroyTree(tree);
 
-	Pyros_List_Free(tags, (Pyros_Free_Callback)Pyros_Free_Tag);
+	DestroyForest(forest);
 	close_db(pyrosDB);
 }
 
@@ -642,9 +1324,11 @@ remove_file(int argc, char **argv) {
 	PyrosDB *pyrosDB = open_db(PDB_PATH);
 
 	for (int i = 0; i < argc; i++) {
-		PyrosFile *pFile = Pyros_Get_File_From_Hash(pyrosDB, argv[i]);
+		PyrosFile *pFile =
+		    QUERY(Pyros_Get_File_From_Hash(pyrosDB, argv[i]));
 		if (pFile != NULL) {
 			CHECK_ERROR(Pyros_Remove_File(pyrosDB, pFile));
+			StatsAdd(STATS_FILES, 1);
 			Pyros_Free_File(pFile);
 		} else if (Pyros_Get_Error_Type(pyrosDB) != PYROS_OK) {
 			SHOW_ERROR_AND_EXIT;
@@ -673,6 +1357,7 @@ static void
 add_tag(int argc, char **argv) {
 	PyrosDB *pyrosDB = open_db(PDB_PATH);
 
+	warn_unknown_tags(&pyrosDB, &argv[1], argc - 1, FALSE);
 	CHECK_ERROR(
 	    Pyros_Add_Tag(pyrosDB, argv[0], (const char **)&argv[1], argc - 1))
 
@@ -692,16 +1377,61 @@ vacuum(int argc, char **argv) {
 	close_db(pyrosDB);
 }
 
+static enum LINK_TYPE
+get_link_type(const char *arg) {
+	if (!strcmp(arg, "hard"))
+		return LINK_HARD;
+	else if (!strcmp(arg, "reflink"))
+		return LINK_REFLINK;
+	else if (!strcmp(arg, "sym"))
+		return LINK_SYM;
+	else if (!strcmp(arg, "auto"))
+		return LINK_AUTO;
+
+	ERROR(stderr, "Unknown link type \"%s\".\n", arg);
+	exit(1);
+}
+
+static enum MANIFEST_FORMAT
+get_manifest_format(const char *arg) {
+	if (!strcmp(arg, "jsonl"))
+		return MANIFEST_JSONL;
+	else if (!strcmp(arg, "tsv"))
+		return MANIFEST_TSV;
+
+	ERROR(stderr, "Unknown manifest format \"%s\".\n", arg);
+	exit(1);
+}
+
 static void export(int argc, char **argv) {
 	PyrosDB *pyrosDB = open_db(PDB_PATH);
 	PyrosList *files =
-	    Pyros_Search(pyrosDB, (const char **)argv + 1, argc - 1);
+	    QUERY(Pyros_Search(pyrosDB, (const char **)argv + 1, argc - 1));
 	PyrosFile *file;
 	PyrosList *tags;
+	ExportPool *pool;
+	struct ExportOptions options;
+	Manifest *manifest = NULL;
+	enum MANIFEST_FORMAT manifest_format = MANIFEST_JSONL;
 	char *dest_path = NULL;
 	size_t i;
 
-	if (files != NULL && files->length > 0) {
+	memset(&options, 0, sizeof(options));
+	options.jobs = 1;
+	options.link_type = LINK_NONE;
+	if (flags & CMD_JOBS_FLAG)
+		options.jobs = get_jobs_arg();
+	if (flags & CMD_LINK_FLAG)
+		options.link_type = get_link_type(link_arg);
+	if (flags & CMD_CHECKSUM_FLAG)
+		options.hash_type = Pyros_Get_Hash_Type(pyrosDB);
+	options.sync = (flags & (CMD_SYNC_FLAG | CMD_CHECKSUM_FLAG)) != 0;
+	options.checksum = (flags & CMD_CHECKSUM_FLAG) != 0;
+	if (flags & CMD_MANIFEST_FLAG)
+		manifest_format = get_manifest_format(manifest_arg);
+
+	if (files != NULL &&
+	    (files->length > 0 || (flags & CMD_DELETE_FLAG))) {
 		if (!pathExists(argv[0])) {
 			ERROR(stderr, "%s does not exist\n", argv[0]);
 			goto end;
@@ -710,12 +1440,21 @@ static void export(int argc, char **argv) {
 			      argv[0]);
 			goto end;
 		}
+	}
 
+	if (files != NULL && files->length > 0) {
+		StatsStart(STATS_COPY);
+		StatsAdd(STATS_FILES, files->length);
+		if (flags & CMD_PROGRESS_FLAG)
+			options.progress = NewProgress(files->length);
+		if (flags & CMD_MANIFEST_FLAG)
+			manifest = OpenManifest(argv[0], manifest_format);
+		pool = NewExportPool(files->length, &options);
 		for (i = 0; i < files->length; i++) {
 			file = files->list[i];
 			dest_path =
 			    malloc(strlen(argv[0]) + strlen(file->hash) +
-			           strlen(file->ext) + 6);
+			           strlen(file->ext) + 7);
 			if (dest_path == NULL) {
 				ERROR(stderr, "Out of memory");
 				exit(1);
@@ -726,24 +1465,634 @@ static void export(int argc, char **argv) {
 			strcat(dest_path, file->hash);
 			strcat(dest_path, ".");
 			strcat(dest_path, file->ext);
-			printf("%s -> %s\n", file->hash, dest_path);
-			cp(file->path, dest_path);
 
 			tags = Pyros_Get_Tags_From_Hash_Simple(
 			    pyrosDB, file->hash, FALSE);
+			StatsAdd(STATS_DB_CALLS, 1);
+			if (tags == NULL) {
+				CHECK_QUERY_ERROR();
+			}
 
-			CHECK_ERROR(Pyros_Get_Error_Type(pyrosDB));
+			/* the manifest replaces the sidecar files */
+			if (manifest != NULL) {
+				ManifestAdd(manifest, file->hash,
+				            &dest_path[strlen(argv[0]) + 1],
+				            tags);
+				Pyros_List_Free(tags, free);
+				tags = NULL;
+			}
 
-			strcat(dest_path, ".txt");
-			if (tags != NULL)
-				writeListToFile(tags, dest_path);
+			ExportPoolAdd(pool, file->hash, file->path, dest_path,
+			              tags, file->file_size);
+		}
+		FinishExportPool(pool);
+		if (manifest != NULL)
+			CloseManifest(manifest);
+		if (options.progress != NULL)
+			FinishProgress(options.progress);
+		StatsStop(STATS_COPY);
+	}
 
-			Pyros_List_Free(tags, free);
-			free(dest_path);
+	/* a mistyped tag matches nothing and would empty the directory */
+	if (files != NULL && (flags & CMD_DELETE_FLAG)) {
+		if (files->length > 0) {
+			PruneExport(argv[0], files);
+		} else {
+			ERROR(stderr, "no files matched, not deleting anything "
+			              "in %s\n", argv[0]);
 		}
 	}
 
 end:
 	Pyros_List_Free(files, (Pyros_Free_Callback)Pyros_Free_File);
-	Pyros_Close_Database(pyrosDB);
+	close_db(pyrosDB);
+}
+
+/* splits line into words in place, words can be quoted with '' or "" and
+ * backslash escapes the next character outside of single quotes.
+ * words[0] is left for the caller and words grows as needed, the count
+ * returned includes it */
+static int
+split_line(char *line, char ***words, size_t *capacity) {
+	char *in = line, *out = line;
+	int count = 1;
+	char quote;
+
+	for (;;) {
+		while (isspace((unsigned char)*in))
+			in++;
+		if (*in == '\0' || *in == '#')
+			break;
+
+		if ((size_t)count >= *capacity) {
+			if (count == INT_MAX) {
+				ERROR(stderr, "too many words in batch line\n");
+				exit(1);
+			}
+			*capacity = *capacity * 2 + 16;
+			if (*capacity > INT_MAX)
+				*capacity = INT_MAX;
+			*words = realloc(*words, sizeof(**words) * *capacity);
+			if (*words == NULL) {
+				ERROR(stderr, "Out of memory\n");
+				exit(1);
+			}
+		}
+		(*words)[count++] = out;
+		quote = '\0';
+		for (; *in != '\0'; in++) {
+			if (quote == '\0' && isspace((unsigned char)*in))
+				break;
+
+			if (quote != '"' && quote != '\'' &&
+			    (*in == '"' || *in == '\'')) {
+				quote = *in;
+			} else if (*in == quote) {
+				quote = '\0';
+			} else if (*in == '\\' && quote != '\'' &&
+			           in[1] != '\0') {
+				*out++ = *++in;
+			} else {
+				*out++ = *in;
+			}
+		}
+
+		if (*in != '\0')
+			in++;
+		*out++ = '\0';
+	}
+	return count;
+}
+
+/* commands exit on errors, this undoes whatever the batch has not committed
+ * yet no matter which error path they took */
+static void
+rollback_batch(int status, void *arg) {
+	UNUSED(arg);
+	if (status != 0 && in_batch && shared_db != NULL)
+		Pyros_Rollback(shared_db);
+}
+
+static void
+batch(int argc, char **argv) {
+	FILE *input = stdin;
+	char *line = NULL;
+	size_t line_capacity = 0;
+	char **words = NULL;
+	size_t word_capacity = 0;
+	int word_count;
+	size_t commit_every = 0;
+	size_t uncommitted = 0;
+	PyrosDB *pyrosDB;
+
+	if (in_batch) {
+		ERROR(stderr, "batch can not be nested\n");
+		exit(1);
+	}
+
+	if (flags & CMD_COMMIT_FLAG)
+		commit_every = get_number_arg(commit_arg, "commit interval");
+
+	if (argc > 0 && strcmp(argv[0], "-")) {
+		if ((input = fopen(argv[0], "r")) == NULL) {
+			ERROR(stderr, "Unable to open file %s\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	pyrosDB = open_db(PDB_PATH);
+	shared_db = pyrosDB;
+	defer_commit = TRUE;
+	in_batch = TRUE;
+	on_exit(&rollback_batch, NULL);
+
+	while (getline(&line, &line_capacity, input) > 0) {
+		word_count = split_line(line, &words, &word_capacity);
+		if (word_count == 1)
+			continue;
+
+		words[0] = (char *)ExecName;
+		parse_input(word_count, words);
+
+		if (commit_every != 0 && ++uncommitted >= commit_every) {
+			commit_now(pyrosDB);
+			uncommitted = 0;
+		}
+	}
+
+	free(line);
+	free(words);
+	if (input != stdin)
+		fclose(input);
+
+	defer_commit = FALSE;
+	in_batch = FALSE;
+	commit_now(pyrosDB);
+	if (!serving) {
+		shared_db = NULL;
+		close_db(pyrosDB);
+	}
+}
+
+struct Relation {
+	char *tag;
+	char *other;
+	int alias;
+};
+
+/* undoes the escapes WriteTSVField adds */
+static void
+unescape_tsv(char *field) {
+	char *out = field;
+
+	for (; *field != '\0'; field++) {
+		if (*field == '\\' && field[1] != '\0') {
+			field++;
+			if (*field == 't')
+				*out++ = '\t';
+			else if (*field == 'n')
+				*out++ = '\n';
+			else
+				*out++ = *field;
+		} else {
+			*out++ = *field;
+		}
+	}
+	*out = '\0';
+}
+
+/* the next line without its line break, skipping empty lines and lines
+ * starting with '#', NULL at the end of input */
+static char *
+read_tsv_line(FILE *input, char **line, size_t *capacity,
+              size_t *line_number) {
+	ssize_t length;
+
+	while ((length = getline(line, capacity, input)) > 0) {
+		(*line_number)++;
+		while (length > 0 && ((*line)[length - 1] == '\n' ||
+		                      (*line)[length - 1] == '\r'))
+			(*line)[--length] = '\0';
+		if (length > 0 && (*line)[0] != '#')
+			return *line;
+	}
+	return NULL;
+}
+
+static FILE *
+open_input_arg(int argc, char **argv, const char **name) {
+	FILE *input;
+
+	*name = "<stdin>";
+	if (argc == 0 || !strcmp(argv[0], "-"))
+		return stdin;
+
+	if ((input = fopen(argv[0], "r")) == NULL) {
+		ERROR(stderr, "Unable to open file %s\n", argv[0]);
+		exit(1);
+	}
+	*name = argv[0];
+	return input;
+}
+
+static void
+report_throughput(const struct timespec *start, const char *what,
+                  size_t added, size_t duplicates) {
+	struct timespec end;
+	double seconds;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	seconds = (end.tv_sec - start->tv_sec) +
+	          (end.tv_nsec - start->tv_nsec) / 1e9;
+	fprintf(stderr,
+	        "%s: %zu %s added, %zu duplicates skipped in %.3fs "
+	        "(%.0f/s)\n",
+	        ExecName, added, what, duplicates, seconds,
+	        seconds > 0 ? added / seconds : 0.0);
+}
+
+static int
+compare_relations(const void *a, const void *b) {
+	const struct Relation *x = a;
+	const struct Relation *y = b;
+	int cmp;
+
+	if (x->alias != y->alias)
+		return x->alias - y->alias;
+	if ((cmp = strcmp(x->tag, y->tag)) != 0)
+		return cmp;
+	return strcmp(x->other, y->other);
+}
+
+/* every line is tag<TAB>parent or tag<TAB>other<TAB>parent|alias, empty
+ * lines and lines starting with '#' are skipped */
+static size_t
+read_relations(FILE *input, const char *name, struct Relation **relations) {
+	char *line = NULL;
+	size_t line_capacity = 0;
+	size_t count = 0, capacity = 0, line_number = 0;
+	char *fields[4];
+	int field_count;
+	char *rest, *swap;
+	struct Relation *relation;
+
+	while (read_tsv_line(input, &line, &line_capacity, &line_number)) {
+		rest = line;
+		for (field_count = 0; field_count < 4; field_count++) {
+			if ((fields[field_count] = strsep(&rest, "\t")) == NULL)
+				break;
+		}
+		if (field_count < 2 || field_count > 3 || *fields[0] == '\0' ||
+		    *fields[1] == '\0' ||
+		    (field_count == 3 && strcmp(fields[2], "parent") &&
+		     strcmp(fields[2], "alias"))) {
+			ERROR(stderr,
+			      "%s:%zu: expected tag, parent or tag, tag, alias\n",
+			      name, line_number);
+			exit(1);
+		}
+
+		if (count == capacity) {
+			capacity = capacity * 2 + 1024;
+			*relations =
+			    realloc(*relations, sizeof(**relations) * capacity);
+			if (*relations == NULL) {
+				ERROR(stderr, "Out of memory\n");
+				exit(1);
+			}
+		}
+
+		unescape_tsv(fields[0]);
+		unescape_tsv(fields[1]);
+		relation = &(*relations)[count++];
+		relation->alias = field_count == 3 && !strcmp(fields[2], "alias");
+
+		/* aliases go both ways, one order lets duplicates meet */
+		if (relation->alias && strcmp(fields[0], fields[1]) > 0) {
+			swap = fields[0];
+			fields[0] = fields[1];
+			fields[1] = swap;
+		}
+		relation->tag = strdup(fields[0]);
+		relation->other = strdup(fields[1]);
+		if (relation->tag == NULL || relation->other == NULL) {
+			ERROR(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+
+	free(line);
+	return count;
+}
+
+/* reads every relation before touching the database, so a malformed
+ * line leaves it unchanged, then adds them deduplicated and sorted by
+ * tag in one transaction unless -n asks for more commits */
+static void
+import_relations(int argc, char **argv) {
+	FILE *input;
+	const char *name;
+	struct Relation *relations = NULL;
+	struct timespec start;
+	size_t count, unique, i;
+	size_t commit_every = 0;
+	size_t uncommitted = 0;
+	Progress *progress = NULL;
+	PyrosDB *pyrosDB;
+
+	if (flags & CMD_COMMIT_FLAG)
+		commit_every = get_number_arg(commit_arg, "commit interval");
+	input = open_input_arg(argc, argv, &name);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	StatsStart(STATS_INPUT);
+	count = read_relations(input, name, &relations);
+	if (input != stdin)
+		fclose(input);
+
+	qsort(relations, count, sizeof(*relations), &compare_relations);
+	for (unique = 0, i = 0; i < count; i++) {
+		if (unique > 0 &&
+		    !compare_relations(&relations[i], &relations[unique - 1])) {
+			free(relations[i].tag);
+			free(relations[i].other);
+			continue;
+		}
+		relations[unique++] = relations[i];
+	}
+	StatsStop(STATS_INPUT);
+
+	pyrosDB = open_db(PDB_PATH);
+	if (flags & CMD_PROGRESS_FLAG)
+		progress = NewProgress(unique);
+
+	StatsStart(STATS_IMPORT);
+	for (i = 0; i < unique; i++) {
+		if (relations[i].alias) {
+			CHECK_ERROR(Pyros_Add_Alias(pyrosDB, relations[i].tag,
+			                            relations[i].other));
+		} else {
+			CHECK_ERROR(Pyros_Add_Parent(pyrosDB, relations[i].other,
+			                             relations[i].tag));
+		}
+
+		if (progress != NULL)
+			ProgressAdvance(progress, 1, 0, relations[i].tag);
+		if (commit_every != 0 && ++uncommitted >= commit_every) {
+			commit(pyrosDB);
+			uncommitted = 0;
+		}
+	}
+	StatsStop(STATS_IMPORT);
+
+	if (progress != NULL)
+		FinishProgress(progress);
+	commit(pyrosDB);
+	close_db(pyrosDB);
+
+	report_throughput(&start, "relations", unique, count - unique);
+
+	for (i = 0; i < unique; i++) {
+		free(relations[i].tag);
+		free(relations[i].other);
+	}
+	free(relations);
+}
+
+struct TagPair {
+	char *hash;
+	char *tag;
+};
+
+static int
+compare_tag_pairs(const void *a, const void *b) {
+	const struct TagPair *x = a;
+	const struct TagPair *y = b;
+	int cmp;
+
+	if ((cmp = strcmp(x->hash, y->hash)) != 0)
+		return cmp;
+	return strcmp(x->tag, y->tag);
+}
+
+/* every line is hash<TAB>tag[<TAB>tag]... and becomes a pair per tag.
+ * each line is copied once into lines and its pairs point into that copy,
+ * so a hash is stored once no matter how many tags it gets */
+static size_t
+read_tag_pairs(FILE *input, const char *name, struct TagPair **pairs,
+               char ***lines, size_t *line_count) {
+	char *line = NULL;
+	size_t line_capacity = 0;
+	size_t count = 0, capacity = 0, line_number = 0;
+	size_t lines_capacity = 0;
+	size_t first;
+	char *rest, *hash, *tag;
+
+	while (read_tsv_line(input, &line, &line_capacity, &line_number)) {
+		if (*line_count == lines_capacity) {
+			lines_capacity = lines_capacity * 2 + 1024;
+			*lines = realloc(*lines, sizeof(**lines) * lines_capacity);
+			if (*lines == NULL) {
+				ERROR(stderr, "Out of memory\n");
+				exit(1);
+			}
+		}
+		if ((rest = strdup(line)) == NULL) {
+			ERROR(stderr, "Out of memory\n");
+			exit(1);
+		}
+		(*lines)[(*line_count)++] = rest;
+
+		first = count;
+		hash = strsep(&rest, "\t");
+		while (*hash != '\0' && (tag = strsep(&rest, "\t")) != NULL) {
+			if (*tag == '\0')
+				continue;
+
+			if (count == capacity) {
+				capacity = capacity * 2 + 1024;
+				*pairs = realloc(*pairs, sizeof(**pairs) * capacity);
+				if (*pairs == NULL) {
+					ERROR(stderr, "Out of memory\n");
+					exit(1);
+				}
+			}
+
+			unescape_tsv(tag);
+			(*pairs)[count].hash = hash;
+			(*pairs)[count].tag = tag;
+			count++;
+		}
+		if (count == first) {
+			ERROR(stderr, "%s:%zu: expected hash and tags\n", name,
+			      line_number);
+			exit(1);
+		}
+	}
+
+	free(line);
+	return count;
+}
+
+/* reads every pair first and adds the union of each hash's tags with one
+ * Pyros_Add_Tag, committing once at the end or every -n files */
+static void
+tag_batch(int argc, char **argv) {
+	FILE *input;
+	const char *name;
+	struct TagPair *pairs = NULL;
+	char **lines = NULL;
+	struct timespec start;
+	const char **tags;
+	size_t count, unique, first, i;
+	size_t line_count = 0;
+	size_t commit_every = 0;
+	size_t uncommitted = 0;
+	size_t files = 0;
+	Progress *progress = NULL;
+	PyrosDB *pyrosDB;
+
+	if (flags & CMD_COMMIT_FLAG)
+		commit_every = get_number_arg(commit_arg, "commit interval");
+	input = open_input_arg(argc, argv, &name);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	StatsStart(STATS_INPUT);
+	count = read_tag_pairs(input, name, &pairs, &lines, &line_count);
+	if (input != stdin)
+		fclose(input);
+
+	qsort(pairs, count, sizeof(*pairs), &compare_tag_pairs);
+	for (unique = 0, i = 0; i < count; i++) {
+		if (unique > 0 &&
+		    !compare_tag_pairs(&pairs[i], &pairs[unique - 1]))
+			continue;
+		pairs[unique++] = pairs[i];
+	}
+	for (i = 0; i < unique; i++) {
+		if (i == 0 || strcmp(pairs[i].hash, pairs[i - 1].hash))
+			files++;
+	}
+	StatsStop(STATS_INPUT);
+
+	if ((tags = malloc(sizeof(*tags) * (unique + 1))) == NULL) {
+		ERROR(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	pyrosDB = open_db(PDB_PATH);
+	if (flags & CMD_PROGRESS_FLAG)
+		progress = NewProgress(files);
+
+	StatsStart(STATS_IMPORT);
+	for (first = 0; first < unique; first = i) {
+		for (i = first; i < unique &&
+		                !strcmp(pairs[i].hash, pairs[first].hash);
+		     i++)
+			tags[i - first] = pairs[i].tag;
+
+		CHECK_ERROR(Pyros_Add_Tag(pyrosDB, pairs[first].hash, tags,
+		                          i - first));
+
+		if (progress != NULL)
+			ProgressAdvance(progress, 1, 0, pairs[first].hash);
+		if (commit_every != 0 && ++uncommitted >= commit_every) {
+			commit(pyrosDB);
+			uncommitted = 0;
+		}
+	}
+	StatsStop(STATS_IMPORT);
+
+	if (progress != NULL)
+		FinishProgress(progress);
+	commit(pyrosDB);
+	close_db(pyrosDB);
+
+	report_throughput(&start, "tags", unique, count - unique);
+
+	free(tags);
+	free(pairs);
+	for (i = 0; i < line_count; i++)
+		free(lines[i]);
+	free(lines);
+}
+
+/* a SQLite handle must not cross a fork(), every daemon worker opens its
+ * own after it was forked */
+static void
+open_worker_db() {
+	shared_db = open_db(PDB_PATH);
+}
+
+static void
+serve(int argc, char **argv) {
+	UNUSED(argc);
+	UNUSED(argv);
+
+	if (shared_db != NULL) {
+		ERROR(stderr, "serve can not be used here\n");
+		exit(1);
+	}
+
+	/* fail here rather than in every worker */
+	close_db(open_db(PDB_PATH));
+
+	serving = TRUE;
+	ServeDaemon(PDB_PATH, &open_worker_db, &parse_input);
+	serving = FALSE;
+}
+
+static int
+command_is_read_only(const struct Cmd *cmd) {
+	static const Command read_only[] = {
+	    &help,         &version,     &search,    &list_hash,    &list_tags,
+	    &complete_tag, &suggest_tag, &get_alias, &get_children, &get_parents,
+	    &get_hash,     &get_related, &export,
+	};
+
+	for (size_t i = 0; i < LENGTH(read_only); i++)
+		if (cmd->func == read_only[i])
+			return TRUE;
+	return FALSE;
+}
+
+/* runs right before a command, hands it over to a daemon serving the
+ * database if there is one or, inside the daemon, waits until it can run
+ * alongside the other requests */
+void
+before_command(const struct Cmd *cmd, int argc, char **argv) {
+	static int locked = FALSE;
+	int status;
+
+	/* a batch holds the lock for all of its commands */
+	if (serving) {
+		if (!locked)
+			LockDaemonDatabase(PDB_PATH,
+			                   !command_is_read_only(cmd));
+		locked = TRUE;
+		return;
+	}
+
+	if (shared_db != NULL || cmd->func == &serve || cmd->func == &create)
+		return;
+
+	if ((status = ForwardToDaemon(PDB_PATH, argc, argv)) >= 0)
+		exit(status);
+}
+
+/* help exits, inside a batch that would drop the lines left and whatever
+ * was not committed yet without any error */
+void
+before_help() {
+	if (in_batch) {
+		ERROR(stderr, "help can not be shown inside a batch\n");
+		exit(1);
+	}
+}
+
+void
+after_command(const struct Cmd *cmd) {
+	/* commands run by a batch are part of its report */
+	if (!in_batch)
+		PrintStats(cmd->longName);
 }
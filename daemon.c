@@ -0,0 +1,391 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "pyros_cli.h"
+
+#define SOCKET_NAME "pyros.sock"
+#define LOCK_NAME "pyros.lock"
+#define MAX_REQUEST_SIZE (1 << 20)
+
+extern const char *ExecName;
+
+static volatile sig_atomic_t stop_serving = FALSE;
+
+static char *
+daemon_path(const char *db_path, const char *name) {
+	size_t len = strlen(db_path);
+	char *path = malloc(len + strlen(name) + 2);
+	if (path == NULL) {
+		ERROR(stderr, "Out of memory");
+		exit(1);
+	}
+
+	strcpy(path, db_path);
+	if (len == 0 || path[len - 1] != '/')
+		strcat(path, "/");
+	strcat(path, name);
+	return path;
+}
+
+static int
+socket_address(const char *db_path, struct sockaddr_un *addr) {
+	char *path = daemon_path(db_path, SOCKET_NAME);
+	int fits = strlen(path) < sizeof(addr->sun_path);
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (fits)
+		strcpy(addr->sun_path, path);
+	free(path);
+	return fits;
+}
+
+static int
+write_all(int fd, const void *buf, size_t len) {
+	const char *ptr = buf;
+	ssize_t written;
+
+	while (len > 0) {
+		written = write(fd, ptr, len);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return FALSE;
+		}
+		ptr += written;
+		len -= written;
+	}
+	return TRUE;
+}
+
+static int
+read_all(int fd, void *buf, size_t len) {
+	char *ptr = buf;
+	ssize_t read_bytes;
+
+	while (len > 0) {
+		read_bytes = read(fd, ptr, len);
+		if (read_bytes < 0 && errno == EINTR)
+			continue;
+		if (read_bytes <= 0)
+			return FALSE;
+		ptr += read_bytes;
+		len -= read_bytes;
+	}
+	return TRUE;
+}
+
+/* a request is the request size followed by the working directory and the
+ * arguments as NUL terminated strings, stdin, stdout and stderr travel
+ * alongside it so the command can use them directly */
+static int
+send_request(int fd, const char *cwd, int argc, char **argv) {
+	int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	uint32_t size = strlen(cwd) + 1;
+	char *payload, *ptr;
+	int ret;
+
+	for (int i = 0; i < argc; i++)
+		size += strlen(argv[i]) + 1;
+	if (size > MAX_REQUEST_SIZE)
+		return FALSE;
+
+	if ((payload = malloc(size)) == NULL)
+		return FALSE;
+
+	ptr = stpcpy(payload, cwd) + 1;
+	for (int i = 0; i < argc; i++)
+		ptr = stpcpy(ptr, argv[i]) + 1;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	iov.iov_base = &size;
+	iov.iov_len = sizeof(size);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	ret = sendmsg(fd, &msg, MSG_NOSIGNAL) == sizeof(size) &&
+	      write_all(fd, payload, size);
+	free(payload);
+	return ret;
+}
+
+/* returns the command's exit status, or -1 when no daemon is listening and
+ * the command should run here instead */
+int
+ForwardToDaemon(const char *db_path, int argc, char **argv) {
+	struct sockaddr_un addr;
+	int32_t status;
+	char *cwd;
+	int fd;
+
+	if (getenv("PYROS_NO_DAEMON") != NULL ||
+	    !socket_address(db_path, &addr))
+		return -1;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+
+	if ((cwd = getcwd(NULL, 0)) == NULL || !send_request(fd, cwd, argc, argv)) {
+		free(cwd);
+		close(fd);
+		return -1;
+	}
+	free(cwd);
+
+	/* from here on the daemon has the command, running it again locally
+	 * could apply it twice */
+	if (!read_all(fd, &status, sizeof(status))) {
+		ERROR(stderr, "lost connection to daemon\n");
+		status = 1;
+	}
+
+	close(fd);
+	return status;
+}
+
+static int request_client = -1;
+
+/* registered with on_exit() so the status reaches the client however the
+ * command ends, stdio is flushed first so all of its output comes before
+ * the client returns */
+static void
+send_status(int exit_status, void *arg) {
+	int32_t status = exit_status;
+
+	UNUSED(arg);
+	fflush(NULL);
+	write_all(request_client, &status, sizeof(status));
+	close(request_client);
+}
+
+static void
+run_request(int client, void (*run)(int argc, char **argv)) {
+	char control[CMSG_SPACE(sizeof(int) * 3)];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	uint32_t size;
+	int fds[3] = {-1, -1, -1};
+	char *payload, *ptr;
+	char **argv;
+	int argc = 0;
+
+	request_client = client;
+	on_exit(&send_status, NULL);
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &size;
+	iov.iov_len = sizeof(size);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	if (recvmsg(client, &msg, MSG_CMSG_CLOEXEC) != sizeof(size) ||
+	    size == 0 || size > MAX_REQUEST_SIZE)
+		exit(1);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+		exit(1);
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+	if ((payload = malloc(size)) == NULL ||
+	    (argv = malloc(sizeof(*argv) * (size + 1))) == NULL ||
+	    !read_all(client, payload, size) || payload[size - 1] != '\0')
+		exit(1);
+
+	ptr = payload + strlen(payload) + 1;
+	while (ptr < payload + size) {
+		argv[argc++] = ptr;
+		ptr += strlen(ptr) + 1;
+	}
+	argv[argc] = NULL;
+
+	fflush(NULL);
+	for (int i = 0; i < 3; i++) {
+		dup2(fds[i], i);
+		close(fds[i]);
+	}
+
+	if (chdir(payload)) {
+		ERROR(stderr, "Unable to change directory to %s\n", payload);
+		exit(1);
+	}
+
+	run(argc, argv);
+	exit(0);
+}
+
+/* a worker sets itself up (opening its own database handle) before it
+ * waits for a client, tells the daemon once it has one and then runs that
+ * single request in-process */
+static void
+run_worker(int listener, int ready, void (*setup)(void),
+           void (*run)(int argc, char **argv)) {
+	int client;
+
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+
+	setup();
+
+	while ((client = accept4(listener, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+		if (errno != EINTR && errno != ECONNABORTED)
+			_exit(1);
+	}
+
+	write_all(ready, "", 1);
+	close(ready);
+	close(listener);
+	run_request(client, run);
+}
+
+static void
+handle_stop(int sig) {
+	UNUSED(sig);
+	stop_serving = TRUE;
+}
+
+/* accepts requests until SIGINT/SIGTERM. Nothing opened by the daemon
+ * itself is shared with requests: there is always one forked worker that
+ * has already run setup and is waiting for the next client, so a request
+ * costs no fork and no open, and a new worker is started once it is
+ * taken. */
+void
+ServeDaemon(const char *db_path, void (*setup)(void),
+            void (*run)(int argc, char **argv)) {
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	mode_t old_umask;
+	int listener;
+	int ready[2];
+	int bound;
+	ssize_t read_bytes;
+	char byte;
+	pid_t pid;
+
+	if (!socket_address(db_path, &addr)) {
+		ERROR(stderr, "database path too long for a socket\n");
+		exit(1);
+	}
+
+	if ((listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+		ERROR(stderr, "Unable to create socket: %s\n",
+		      strerror(errno));
+		exit(1);
+	}
+
+	if (connect(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		ERROR(stderr, "a daemon is already serving %s\n", db_path);
+		exit(1);
+	}
+	/* left over from a daemon that didn't shut down cleanly */
+	unlink(addr.sun_path);
+
+	old_umask = umask(077);
+	bound = bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+	umask(old_umask);
+
+	if (!bound || listen(listener, 128)) {
+		ERROR(stderr, "Unable to listen on %s: %s\n", addr.sun_path,
+		      strerror(errno));
+		exit(1);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = &handle_stop;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	while (!stop_serving) {
+		if (pipe2(ready, O_CLOEXEC)) {
+			ERROR(stderr, "Unable to create pipe: %s\n",
+			      strerror(errno));
+			break;
+		}
+
+		fflush(NULL);
+		if ((pid = fork()) == 0) {
+			close(ready[0]);
+			run_worker(listener, ready[1], setup, run);
+		}
+		close(ready[1]);
+
+		if (pid < 0) {
+			ERROR(stderr, "Unable to start worker: %s\n",
+			      strerror(errno));
+			close(ready[0]);
+			break;
+		}
+
+		do
+			read_bytes = read(ready[0], &byte, 1);
+		while (read_bytes < 0 && errno == EINTR && !stop_serving);
+		close(ready[0]);
+
+		if (read_bytes != 1) {
+			/* the idle worker holds no request, it can just go */
+			kill(pid, SIGTERM);
+			if (read_bytes == 0 && !stop_serving) {
+				ERROR(stderr, "worker exited before serving a "
+				              "request\n");
+				break;
+			}
+		}
+	}
+
+	close(listener);
+	unlink(addr.sun_path);
+}
+
+/* readers share the lock, writers get it to themselves, held until the
+ * request's process exits */
+void
+LockDaemonDatabase(const char *db_path, int exclusive) {
+	char *path = daemon_path(db_path, LOCK_NAME);
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+	free(path);
+	if (fd < 0 || flock(fd, exclusive ? LOCK_EX : LOCK_SH)) {
+		ERROR(stderr, "Unable to lock database: %s\n", strerror(errno));
+		exit(1);
+	}
+}
@@ -0,0 +1,11 @@
+#ifndef PYROS_CLI_DAEMON_H
+#define PYROS_CLI_DAEMON_H
+
+int ForwardToDaemon(const char *db_path, int argc, char **argv);
+
+void ServeDaemon(const char *db_path, void (*setup)(void),
+                 void (*run)(int argc, char **argv));
+
+void LockDaemonDatabase(const char *db_path, int exclusive);
+
+#endif
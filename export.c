@@ -0,0 +1,463 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <pyros.h>
+
+#include "export.h"
+#include "files.h"
+#include "hash.h"
+#include "output.h"
+#include "progress.h"
+#include "pyros_cli.h"
+#include "stats.h"
+
+extern const char *ExecName;
+
+/* hex digits in the longest digest libpyros can use */
+#define EXPORT_MAX_HASH_LENGTH 128
+
+struct ExportResult {
+	const char *hash;
+	const char *src;
+	char *dest;
+	PyrosList *tags;
+	size_t size;
+
+	enum COPY_METHOD method;
+	int copy_errno;
+	int tags_written;
+	int done;
+};
+
+/* the main thread resolves everything that needs the database and queues
+ * the copies, a fixed number of workers do the actual I/O and results are
+ * reported in the order they were queued */
+struct ExportPool {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	pthread_cond_t done;
+
+	size_t *queue;
+	size_t queue_capacity;
+	size_t queue_head;
+	size_t queue_length;
+	int closed;
+
+	struct ExportResult *results;
+	size_t result_count;
+	size_t next_report;
+
+	pthread_t *threads;
+	int thread_count;
+
+	struct ExportOptions options;
+};
+
+static int
+is_up_to_date(const ExportPool *pool, const struct ExportResult *result,
+              const struct stat *src) {
+	struct stat dest;
+	char *hash;
+	int same;
+
+	if (stat(result->dest, &dest) || dest.st_size != src->st_size)
+		return FALSE;
+
+	/* whole seconds like rsync, not every filesystem keeps more */
+	if (!pool->options.checksum)
+		return dest.st_mtime == src->st_mtime;
+
+	if ((hash = hashFile(result->dest, pool->options.hash_type)) == NULL)
+		return FALSE;
+	same = !strcmp(hash, result->hash);
+	free(hash);
+	return same;
+}
+
+static void
+export_file(ExportPool *pool, struct ExportResult *result) {
+	struct stat src;
+	struct timespec times[2];
+	int sync = pool->options.sync;
+
+	if (sync && stat(result->src, &src) == 0) {
+		if (is_up_to_date(pool, result, &src)) {
+			result->method = COPY_UP_TO_DATE;
+			return;
+		}
+	} else {
+		sync = FALSE;
+	}
+
+	result->method =
+	    linkFile(result->src, result->dest, pool->options.link_type);
+	result->copy_errno = errno;
+
+	/* links, reflinks and up to date files moved no data */
+	if (result->method == COPY_FILE_RANGE ||
+	    result->method == COPY_SENDFILE || result->method == COPY_BUFFER)
+		StatsAdd(STATS_BYTES_COPIED, result->size);
+
+	/* copies get the source's mtime so the next sync can skip them */
+	if (sync && result->method != COPY_FAILED &&
+	    result->method != COPY_HARDLINK && result->method != COPY_SYMLINK) {
+		times[0] = src.st_atim;
+		times[1] = src.st_mtim;
+		utimensat(AT_FDCWD, result->dest, times, 0);
+	}
+}
+
+static void *
+export_worker(void *data) {
+	ExportPool *pool = data;
+	struct ExportResult *result;
+	size_t index;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->queue_length == 0 && !pool->closed)
+			pthread_cond_wait(&pool->not_empty, &pool->lock);
+
+		if (pool->queue_length == 0) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+
+		index = pool->queue[pool->queue_head];
+		pool->queue_head =
+		    (pool->queue_head + 1) % pool->queue_capacity;
+		pool->queue_length--;
+		pthread_cond_signal(&pool->not_full);
+		pthread_mutex_unlock(&pool->lock);
+
+		result = &pool->results[index];
+		export_file(pool, result);
+
+		if (result->method != COPY_FAILED && result->tags != NULL) {
+			/* the dest buffer has room for the extension */
+			strcat(result->dest, ".txt");
+			if (!pool->options.sync ||
+			    !listMatchesFile(result->tags, result->dest))
+				result->tags_written =
+				    writeListToFile(result->tags, result->dest);
+			result->dest[strlen(result->dest) - 4] = '\0';
+		}
+		Pyros_List_Free(result->tags, free);
+		result->tags = NULL;
+
+		pthread_mutex_lock(&pool->lock);
+		result->done = TRUE;
+		pthread_cond_broadcast(&pool->done);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return NULL;
+}
+
+/* print every finished result that isn't waiting on an earlier one, has to
+ * be called with the lock held */
+static void
+report_results(ExportPool *pool, int wait) {
+	struct ExportResult *result;
+
+	while (pool->next_report < pool->result_count) {
+		result = &pool->results[pool->next_report];
+		if (!result->done) {
+			if (!wait)
+				break;
+			pthread_cond_wait(&pool->done, &pool->lock);
+			continue;
+		}
+
+		if (pool->options.progress != NULL)
+			ProgressClear(pool->options.progress);
+
+		if (result->method == COPY_FAILED) {
+			ERROR(stderr, "Unable to copy %s to %s: %s\n",
+			      result->src, result->dest,
+			      strerror(result->copy_errno));
+			exit(1);
+		}
+
+		printf("%s -> %s (%s)\n", result->hash, result->dest,
+		       copyMethodName(result->method));
+
+		if (!result->tags_written) {
+			ERROR(stderr, "Unable to open file %s.txt\n",
+			      result->dest);
+		}
+
+		if (pool->options.progress != NULL)
+			ProgressAdvance(pool->options.progress, 1,
+			                result->size, result->dest);
+
+		free(result->dest);
+		result->dest = NULL;
+		pool->next_report++;
+	}
+}
+
+ExportPool *
+NewExportPool(size_t count, const struct ExportOptions *options) {
+	ExportPool *pool = calloc(1, sizeof(*pool));
+	size_t jobs = options->jobs > 0 ? (size_t)options->jobs : 1;
+	if (pool == NULL || jobs > SIZE_MAX / 4 / sizeof(*pool->queue))
+		goto error_oom;
+
+	pool->options = *options;
+	pool->queue_capacity = jobs * 4;
+	pool->queue = malloc(sizeof(*pool->queue) * pool->queue_capacity);
+	pool->results = calloc(count, sizeof(*pool->results));
+	pool->threads = malloc(sizeof(*pool->threads) * jobs);
+	if (pool->queue == NULL || pool->results == NULL ||
+	    pool->threads == NULL)
+		goto error_oom;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->not_empty, NULL);
+	pthread_cond_init(&pool->not_full, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (size_t i = 0; i < jobs; i++) {
+		if (pthread_create(&pool->threads[i], NULL, &export_worker,
+		                   pool)) {
+			if (i == 0) {
+				ERROR(stderr, "Unable to start export thread\n");
+				exit(1);
+			}
+			break;
+		}
+		pool->thread_count++;
+	}
+
+	return pool;
+error_oom:
+	ERROR(stderr, "Out of memory");
+	exit(1);
+}
+
+/* takes ownership of dest (which needs 5 spare bytes for the tag file
+ * extension) and tags, size is only used for progress */
+void
+ExportPoolAdd(ExportPool *pool, const char *hash, const char *src, char *dest,
+              PyrosList *tags, size_t size) {
+	struct ExportResult *result = &pool->results[pool->result_count];
+
+	result->hash = hash;
+	result->src = src;
+	result->dest = dest;
+	result->tags = tags;
+	result->size = size;
+	result->tags_written = TRUE;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->queue_length == pool->queue_capacity)
+		pthread_cond_wait(&pool->not_full, &pool->lock);
+
+	pool->queue[(pool->queue_head + pool->queue_length) %
+	            pool->queue_capacity] = pool->result_count;
+	pool->queue_length++;
+	pool->result_count++;
+	pthread_cond_signal(&pool->not_empty);
+
+	report_results(pool, FALSE);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void
+FinishExportPool(ExportPool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->closed = TRUE;
+	pthread_cond_broadcast(&pool->not_empty);
+	report_results(pool, TRUE);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 0; i < pool->thread_count; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->not_empty);
+	pthread_cond_destroy(&pool->not_full);
+	pthread_cond_destroy(&pool->done);
+
+	free(pool->queue);
+	free(pool->results);
+	free(pool->threads);
+	free(pool);
+}
+
+static int
+cmp_hash(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* names export gives files: a hex digest, a dot and the extension */
+static size_t
+export_name_hash_length(const char *name) {
+	size_t length = 0;
+
+	while (isxdigit((unsigned char)name[length]))
+		length++;
+	return length >= 32 && name[length] == '.' ? length : 0;
+}
+
+/* removes files left in dir by an earlier export whose hash is not among
+ * files any more, anything not named like an export is left alone */
+void
+PruneExport(const char *dir, const PyrosList *files) {
+	char **keep = malloc(sizeof(*keep) * (files->length + 1));
+	char hash[EXPORT_MAX_HASH_LENGTH + 1];
+	const char *name_hash = hash;
+	struct dirent *entry;
+	size_t length;
+	char *path;
+	DIR *dirp;
+
+	if (keep == NULL)
+		goto error_oom;
+
+	for (size_t i = 0; i < files->length; i++)
+		keep[i] = ((PyrosFile *)files->list[i])->hash;
+	qsort(keep, files->length, sizeof(*keep), &cmp_hash);
+
+	if ((dirp = opendir(dir)) == NULL) {
+		ERROR(stderr, "Unable to open directory %s: %s\n", dir,
+		      strerror(errno));
+		exit(1);
+	}
+
+	while ((entry = readdir(dirp)) != NULL) {
+		length = export_name_hash_length(entry->d_name);
+		if (length == 0 || length > EXPORT_MAX_HASH_LENGTH)
+			continue;
+
+		memcpy(hash, entry->d_name, length);
+		hash[length] = '\0';
+		if (bsearch(&name_hash, keep, files->length, sizeof(*keep),
+		            &cmp_hash) != NULL)
+			continue;
+
+		if ((path = malloc(strlen(dir) + strlen(entry->d_name) + 2)) ==
+		    NULL)
+			goto error_oom;
+		strcpy(path, dir);
+		strcat(path, "/");
+		strcat(path, entry->d_name);
+
+		if (unlinkat(dirfd(dirp), entry->d_name, 0) == 0) {
+			printf("%s (deleted)\n", path);
+		} else if (errno != EISDIR && errno != EPERM) {
+			ERROR(stderr, "Unable to delete %s: %s\n", path,
+			      strerror(errno));
+		}
+		free(path);
+	}
+
+	closedir(dirp);
+	free(keep);
+	return;
+error_oom:
+	ERROR(stderr, "Out of memory");
+	exit(1);
+}
+
+struct Manifest {
+	OutputWriter *out;
+	enum MANIFEST_FORMAT format;
+	char *path;
+	char *tmp_path;
+	int fd;
+};
+
+/* all hash -> tags mappings of an export in one file, written to a
+ * temporary name first so an interrupted export leaves the old one */
+Manifest *
+OpenManifest(const char *dir, enum MANIFEST_FORMAT format) {
+	Manifest *manifest = malloc(sizeof(*manifest));
+	const char *name =
+	    format == MANIFEST_JSONL ? "manifest.jsonl" : "manifest.tsv";
+
+	if (manifest == NULL ||
+	    (manifest->path = malloc(strlen(dir) + strlen(name) + 2)) == NULL ||
+	    (manifest->tmp_path = malloc(strlen(dir) + strlen(name) + 6)) ==
+	        NULL)
+		goto error_oom;
+
+	sprintf(manifest->path, "%s/%s", dir, name);
+	sprintf(manifest->tmp_path, "%s.tmp", manifest->path);
+
+	manifest->fd = open(manifest->tmp_path,
+	                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (manifest->fd < 0) {
+		ERROR(stderr, "Unable to open file %s: %s\n",
+		      manifest->tmp_path, strerror(errno));
+		exit(1);
+	}
+
+	manifest->format = format;
+	manifest->out = NewOutputWriter(manifest->fd, '\n');
+	return manifest;
+error_oom:
+	ERROR(stderr, "Out of memory");
+	exit(1);
+}
+
+/* tags may be NULL when the file has none, it gets an empty list */
+void
+ManifestAdd(Manifest *manifest, const char *hash, const char *name,
+            const PyrosList *tags) {
+	OutputWriter *out = manifest->out;
+	size_t tag_count = tags != NULL ? tags->length : 0;
+	size_t i;
+
+	if (manifest->format == MANIFEST_JSONL) {
+		WriteString(out, "{\"hash\":");
+		WriteJSONString(out, hash);
+		WriteString(out, ",\"file\":");
+		WriteJSONString(out, name);
+		WriteString(out, ",\"tags\":[");
+		for (i = 0; i < tag_count; i++) {
+			if (i > 0)
+				WriteString(out, ",");
+			WriteJSONString(out, tags->list[i]);
+		}
+		WriteString(out, "]}\n");
+	} else {
+		WriteTSVField(out, hash);
+		WriteString(out, "\t");
+		WriteTSVField(out, name);
+		for (i = 0; i < tag_count; i++) {
+			WriteString(out, "\t");
+			WriteTSVField(out, tags->list[i]);
+		}
+		WriteString(out, "\n");
+	}
+}
+
+void
+CloseManifest(Manifest *manifest) {
+	CloseOutputWriter(manifest->out);
+
+	if (close(manifest->fd) ||
+	    rename(manifest->tmp_path, manifest->path)) {
+		ERROR(stderr, "Unable to write %s: %s\n", manifest->path,
+		      strerror(errno));
+		exit(1);
+	}
+
+	free(manifest->path);
+	free(manifest->tmp_path);
+	free(manifest);
+}
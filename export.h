@@ -0,0 +1,42 @@
+#ifndef PYROS_CLI_EXPORT_H
+#define PYROS_CLI_EXPORT_H
+
+#include "files.h"
+#include "progress.h"
+#include "pyros.h"
+
+typedef struct ExportPool ExportPool;
+
+struct ExportOptions {
+	int jobs;
+	enum LINK_TYPE link_type;
+	/* skip destinations that already match their source */
+	int sync;
+	/* match by content hash instead of size and mtime */
+	int checksum;
+	enum PYROS_HASHTYPE hash_type;
+	Progress *progress;
+};
+
+ExportPool *NewExportPool(size_t count, const struct ExportOptions *options);
+
+void ExportPoolAdd(ExportPool *pool, const char *hash, const char *src,
+                   char *dest, PyrosList *tags, size_t size);
+
+void FinishExportPool(ExportPool *pool);
+
+void PruneExport(const char *dir, const PyrosList *files);
+
+enum MANIFEST_FORMAT {
+	MANIFEST_JSONL,
+	MANIFEST_TSV,
+};
+
+typedef struct Manifest Manifest;
+
+Manifest *OpenManifest(const char *dir, enum MANIFEST_FORMAT format);
+void ManifestAdd(Manifest *manifest, const char *hash, const char *name,
+                 const PyrosList *tags);
+void CloseManifest(Manifest *manifest);
+
+#endif
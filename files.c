@@ -1,12 +1,23 @@
+#define _GNU_SOURCE
+
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <unistd.h>
+
+#include <linux/fs.h>
 
 #include <pyros.h>
 
+#include "files.h"
 #include "pyros_cli.h"
 
 extern const char *ExecName;
@@ -38,57 +49,304 @@ isFile(const char *path) {
 	return S_ISREG(statbuf.st_mode);
 }
 
-void
-cp(const char *src_path, const char *dest_path) {
-	FILE *src, *dest;
-	char buf[4096];
-	size_t read_bytes, written_bytes;
-	char *ptr;
-
-	src = fopen(src_path, "rb");
-	if (src == NULL) {
-		ERROR(stderr, "Unable to open source file %s", src_path);
-		exit(1);
-	}
+#define COPY_BUFFER_SIZE (1 << 20)
+#define COPY_CHUNK_SIZE (1 << 30)
 
-	dest = fopen(dest_path, "wb");
-	if (dest == NULL) {
-		ERROR(stderr, "Unable to open destination file %s", dest_path);
+static int
+copy_fallback_errno(int err) {
+	return err == ENOSYS || err == EXDEV || err == EINVAL ||
+	       err == EOPNOTSUPP || err == ENOTSUP || err == EBADF;
+}
+
+static enum COPY_METHOD
+copy_buffer(int src, int dest) {
+	char *buf, *ptr;
+	ssize_t read_bytes, written_bytes;
+	int err;
+
+	if (posix_memalign((void **)&buf, 4096, COPY_BUFFER_SIZE)) {
+		ERROR(stderr, "Out of memory");
 		exit(1);
 	}
 
-	while ((read_bytes = fread(buf, sizeof(*buf), 4096, src)) > 0) {
-		ptr = buf;
+	while ((read_bytes = read(src, buf, COPY_BUFFER_SIZE)) != 0) {
+		if (read_bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			goto error;
+		}
 
+		ptr = buf;
 		while (read_bytes > 0) {
-			written_bytes =
-			    fwrite(ptr, sizeof(*ptr), read_bytes, dest);
+			written_bytes = write(dest, ptr, read_bytes);
+			if (written_bytes < 0) {
+				if (errno == EINTR)
+					continue;
+				goto error;
+			}
 			read_bytes -= written_bytes;
 			ptr += written_bytes;
 		}
 	}
 
-	fclose(src);
-	fclose(dest);
+	free(buf);
+	return COPY_BUFFER;
+error:
+	err = errno;
+	free(buf);
+	errno = err;
+	return COPY_FAILED;
 }
 
-void
+static enum COPY_METHOD
+clone_data(int src, int dest) {
+#ifdef FICLONE
+	if (ioctl(dest, FICLONE, src) == 0)
+		return COPY_REFLINK;
+#else
+	UNUSED(src);
+	UNUSED(dest);
+	errno = EOPNOTSUPP;
+#endif
+	return COPY_FAILED;
+}
+
+/* let the kernel move the data, each method falls through to the next one
+ * when the filesystems involved don't support it */
+static enum COPY_METHOD
+copy_data(int src, int dest, off_t size) {
+	ssize_t copied;
+	int started = FALSE;
+
+	if (clone_data(src, dest) == COPY_REFLINK)
+		return COPY_REFLINK;
+
+	/* reserve the space only once a reflink is ruled out, KEEP_SIZE so a
+	 * source that shrinks meanwhile doesn't leave zeros at the end */
+	if (size > 0)
+		fallocate(dest, FALLOC_FL_KEEP_SIZE, 0, size);
+
+	while ((copied = copy_file_range(src, NULL, dest, NULL,
+	                                 COPY_CHUNK_SIZE, 0)) != 0) {
+		if (copied < 0) {
+			if (errno == EINTR)
+				continue;
+			if (!started && copy_fallback_errno(errno))
+				goto try_sendfile;
+			return COPY_FAILED;
+		}
+		started = TRUE;
+	}
+	return COPY_FILE_RANGE;
+
+try_sendfile:
+	while ((copied = sendfile(dest, src, NULL, COPY_CHUNK_SIZE)) != 0) {
+		if (copied < 0) {
+			if (errno == EINTR)
+				continue;
+			if (!started && copy_fallback_errno(errno))
+				return copy_buffer(src, dest);
+			return COPY_FAILED;
+		}
+		started = TRUE;
+	}
+	return COPY_SENDFILE;
+}
+
+/* the data goes to a temporary file next to dest_path that is renamed over
+ * it, so an existing dest_path is never written through: it may be a hard
+ * link or symlink to src_path left by an earlier linked export */
+static enum COPY_METHOD
+copy_file(const char *src_path, const char *dest_path, int clone_only) {
+	static unsigned int tmp_counter;
+	struct stat statbuf;
+	enum COPY_METHOD method;
+	char *tmp_path;
+	int src, dest;
+	int err;
+
+	src = open(src_path, O_RDONLY | O_CLOEXEC);
+	if (src < 0)
+		return COPY_FAILED;
+
+	if (fstat(src, &statbuf))
+		goto error_src;
+
+	if ((tmp_path = malloc(strlen(dest_path) + 32)) == NULL) {
+		ERROR(stderr, "Out of memory");
+		exit(1);
+	}
+	sprintf(tmp_path, "%s.%ld.%u.tmp", dest_path, (long)getpid(),
+	        __sync_fetch_and_add(&tmp_counter, 1));
+
+	dest = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	if (dest < 0) {
+		err = errno;
+		free(tmp_path);
+		errno = err;
+		goto error_src;
+	}
+
+	if (clone_only) {
+		method = clone_data(src, dest);
+	} else {
+		posix_fadvise(src, 0, 0, POSIX_FADV_SEQUENTIAL);
+		method = copy_data(src, dest, statbuf.st_size);
+	}
+
+	err = errno;
+	close(src);
+	if (close(dest) && method != COPY_FAILED) {
+		err = errno;
+		method = COPY_FAILED;
+	}
+	if (method != COPY_FAILED && rename(tmp_path, dest_path)) {
+		err = errno;
+		method = COPY_FAILED;
+	}
+	if (method == COPY_FAILED)
+		unlink(tmp_path);
+	free(tmp_path);
+
+	errno = err;
+	return method;
+
+error_src:
+	err = errno;
+	close(src);
+	errno = err;
+	return COPY_FAILED;
+}
+
+/* on failure errno is left describing what went wrong so callers on other
+ * threads can report it later */
+enum COPY_METHOD
+cp(const char *src_path, const char *dest_path) {
+	return copy_file(src_path, dest_path, FALSE);
+}
+
+static int
+replace_with_link(const char *src_path, const char *dest_path, int symbolic) {
+	int ret;
+
+	for (int tries = 0; tries < 2; tries++) {
+		if (symbolic)
+			ret = symlink(src_path, dest_path);
+		else
+			ret = link(src_path, dest_path);
+
+		/* overwrite like cp() would */
+		if (ret == 0 || errno != EEXIST || unlink(dest_path))
+			break;
+	}
+	return ret == 0;
+}
+
+/* link dest to src instead of copying it when type allows, anything that
+ * can't be linked (other device, no permission, ...) is copied instead */
+enum COPY_METHOD
+linkFile(const char *src_path, const char *dest_path, enum LINK_TYPE type) {
+	char *real_path;
+	int linked;
+
+	switch (type) {
+	case LINK_AUTO:
+		/* a reflink shares blocks without aliasing the stored file, so
+		 * editing the export can't change the database */
+		if (copy_file(src_path, dest_path, TRUE) == COPY_REFLINK)
+			return COPY_REFLINK;
+		/* fallthrough */
+	case LINK_HARD:
+		if (replace_with_link(src_path, dest_path, FALSE))
+			return COPY_HARDLINK;
+		break;
+	case LINK_SYM:
+		if (src_path[0] == '/') {
+			linked = replace_with_link(src_path, dest_path, TRUE);
+		} else {
+			if ((real_path = realpath(src_path, NULL)) == NULL)
+				break;
+			linked = replace_with_link(real_path, dest_path, TRUE);
+			free(real_path);
+		}
+		if (linked)
+			return COPY_SYMLINK;
+		break;
+	case LINK_REFLINK:
+	case LINK_NONE:
+		/* cp() already tries a reflink first */
+		break;
+	}
+
+	return cp(src_path, dest_path);
+}
+
+const char *
+copyMethodName(enum COPY_METHOD method) {
+	switch (method) {
+	case COPY_REFLINK:
+		return "reflink";
+	case COPY_FILE_RANGE:
+		return "copy_file_range";
+	case COPY_SENDFILE:
+		return "sendfile";
+	case COPY_BUFFER:
+		return "buffer";
+	case COPY_HARDLINK:
+		return "hardlink";
+	case COPY_SYMLINK:
+		return "symlink";
+	case COPY_UP_TO_DATE:
+		return "up to date";
+	default:
+		return "failed";
+	}
+}
+
+int
 writeListToFile(const PyrosList *pList, const char *dest_path) {
 	FILE *dest;
 	size_t i;
 	dest = fopen(dest_path, "w");
 
-	if (dest == NULL) {
-		ERROR(stderr, "Unable to open file %s", dest_path);
-		return;
-	}
+	if (dest == NULL)
+		return FALSE;
 
 	for (i = 0; i < pList->length; i++) {
 		fwrite(pList->list[i], sizeof(char), strlen(pList->list[i]),
 		       dest);
 		fwrite("\n", sizeof(char), 1, dest);
 	}
+	return fclose(dest) == 0;
+}
+
+/* whether dest_path already holds exactly what writeListToFile() would
+ * write for pList */
+int
+listMatchesFile(const PyrosList *pList, const char *dest_path) {
+	FILE *dest;
+	char *line = NULL;
+	size_t line_capacity = 0;
+	ssize_t length;
+	size_t i = 0;
+	int matches = TRUE;
+
+	if ((dest = fopen(dest_path, "r")) == NULL)
+		return FALSE;
+
+	while ((length = getline(&line, &line_capacity, dest)) > 0) {
+		if (i >= pList->length || line[length - 1] != '\n' ||
+		    strlen(pList->list[i]) != (size_t)length - 1 ||
+		    memcmp(line, pList->list[i], length - 1)) {
+			matches = FALSE;
+			break;
+		}
+		i++;
+	}
+
+	free(line);
 	fclose(dest);
+	return matches && i == pList->length;
 }
 
 void
@@ -113,48 +371,390 @@ error:
 	exit(1);
 }
 
+#define WALK_MAX_THREADS 64
+#define WALK_MAX_OPEN_DIRS 256
+
+/* a directory found by the walker, kept until the walk finishes so the
+ * results can be handed out in the same breadth-first order as a serial
+ * readdir() walk would produce */
+struct WalkNode {
+	char *path;
+	const char *name;
+	struct WalkNode *parent;
+	DIR *dir;
+	int refs;
+
+	char **files;
+	size_t file_count;
+	size_t file_capacity;
+
+	struct WalkNode **children;
+	size_t child_count;
+	size_t child_capacity;
+};
+
+struct WalkQueue {
+	pthread_mutex_t lock;
+	struct WalkNode **tasks;
+	size_t head;
+	size_t tail;
+	size_t capacity;
+};
+
+struct Walker {
+	struct WalkQueue *queues;
+	int thread_count;
+	int isRecursive;
+	int open_dirs;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t pending;
+	size_t queued;
+	int idle;
+};
+
+struct WalkWorker {
+	struct Walker *walker;
+	int id;
+};
+
+static void
+walk_oom() {
+	ERROR(stderr, "Out of memory");
+	exit(1);
+}
+
+static char *
+join_path(const char *dir, size_t dir_len, const char *name) {
+	size_t name_len = strlen(name);
+	char *path = malloc(dir_len + name_len + 2);
+	if (path == NULL)
+		walk_oom();
+
+	memcpy(path, dir, dir_len);
+	path[dir_len] = '/';
+	memcpy(&path[dir_len + 1], name, name_len + 1);
+	return path;
+}
+
+static struct WalkNode *
+walk_new_node(char *path) {
+	struct WalkNode *node = calloc(1, sizeof(*node));
+	if (node == NULL)
+		walk_oom();
+
+	node->path = path;
+	node->name = path;
+	return node;
+}
+
+static void
+walk_node_add_file(struct WalkNode *node, char *path) {
+	if (node->file_count >= node->file_capacity) {
+		node->file_capacity =
+		    node->file_capacity ? node->file_capacity * 2 : 16;
+		node->files = realloc(
+		    node->files, sizeof(*node->files) * node->file_capacity);
+		if (node->files == NULL)
+			walk_oom();
+	}
+	node->files[node->file_count++] = path;
+}
+
+static void
+walk_node_add_child(struct WalkNode *node, struct WalkNode *child) {
+	if (node->child_count >= node->child_capacity) {
+		node->child_capacity =
+		    node->child_capacity ? node->child_capacity * 2 : 4;
+		node->children =
+		    realloc(node->children,
+		            sizeof(*node->children) * node->child_capacity);
+		if (node->children == NULL)
+			walk_oom();
+	}
+	node->children[node->child_count++] = child;
+}
+
+static void
+walk_release(struct Walker *w, struct WalkNode *node) {
+	if (__sync_sub_and_fetch(&node->refs, 1) == 0) {
+		closedir(node->dir);
+		node->dir = NULL;
+		__sync_sub_and_fetch(&w->open_dirs, 1);
+	}
+}
+
+static void
+walk_push(struct Walker *w, int id, struct WalkNode *node) {
+	struct WalkQueue *q = &w->queues[id];
+
+	pthread_mutex_lock(&q->lock);
+	if (q->tail >= q->capacity) {
+		if (q->head > 0) {
+			memmove(q->tasks, &q->tasks[q->head],
+			        sizeof(*q->tasks) * (q->tail - q->head));
+			q->tail -= q->head;
+			q->head = 0;
+		} else {
+			q->capacity = q->capacity ? q->capacity * 2 : 64;
+			q->tasks =
+			    realloc(q->tasks, sizeof(*q->tasks) * q->capacity);
+			if (q->tasks == NULL)
+				walk_oom();
+		}
+	}
+	q->tasks[q->tail++] = node;
+	pthread_mutex_unlock(&q->lock);
+
+	pthread_mutex_lock(&w->lock);
+	w->pending++;
+	w->queued++;
+	if (w->idle > 0)
+		pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* pop from the back of our own queue, otherwise steal from the front of
+ * someone else's */
+static struct WalkNode *
+walk_pop(struct Walker *w, int id) {
+	struct WalkNode *node = NULL;
+	struct WalkQueue *q;
+
+	for (int i = 0; i < w->thread_count && node == NULL; i++) {
+		q = &w->queues[(id + i) % w->thread_count];
+
+		pthread_mutex_lock(&q->lock);
+		if (q->tail > q->head) {
+			if (i == 0)
+				node = q->tasks[--q->tail];
+			else
+				node = q->tasks[q->head++];
+		}
+		pthread_mutex_unlock(&q->lock);
+	}
+
+	if (node != NULL) {
+		pthread_mutex_lock(&w->lock);
+		w->queued--;
+		pthread_mutex_unlock(&w->lock);
+	}
+	return node;
+}
+
+static void
+walk_dir(struct Walker *w, int id, struct WalkNode *node) {
+	struct dirent *ent;
+	struct stat statbuf;
+	struct WalkNode *child;
+	size_t path_len = strlen(node->path);
+	int fd;
+	int type;
+
+	if (node->parent != NULL) {
+		fd = openat(dirfd(node->parent->dir), node->name,
+		            O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		walk_release(w, node->parent);
+		node->parent = NULL;
+	} else {
+		fd = open(node->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+
+	if (fd < 0)
+		return;
+
+	if ((node->dir = fdopendir(fd)) == NULL) {
+		close(fd);
+		return;
+	}
+	node->refs = 1;
+	__sync_add_and_fetch(&w->open_dirs, 1);
+
+	while ((ent = readdir(node->dir)) != NULL) {
+		if (ent->d_name[0] == '.' &&
+		    (ent->d_name[1] == '.' || ent->d_name[1] == '\0'))
+			continue;
+
+		/* only stat entries the filesystem couldn't classify for us
+		 * and symlinks, which are followed like stat() would */
+		type = ent->d_type;
+		if (type == DT_UNKNOWN || type == DT_LNK) {
+			if (fstatat(dirfd(node->dir), ent->d_name, &statbuf,
+			            0))
+				continue;
+
+			if (S_ISREG(statbuf.st_mode))
+				type = DT_REG;
+			else if (S_ISDIR(statbuf.st_mode))
+				type = DT_DIR;
+			else
+				continue;
+		}
+
+		if (type == DT_REG) {
+			walk_node_add_file(
+			    node, join_path(node->path, path_len, ent->d_name));
+		} else if (type == DT_DIR && w->isRecursive) {
+			child = walk_new_node(
+			    join_path(node->path, path_len, ent->d_name));
+			child->name = &child->path[path_len + 1];
+			walk_node_add_child(node, child);
+
+			if (__sync_fetch_and_add(&w->open_dirs, 0) <
+			    WALK_MAX_OPEN_DIRS) {
+				__sync_add_and_fetch(&node->refs, 1);
+				child->parent = node;
+			}
+			walk_push(w, id, child);
+		}
+	}
+
+	walk_release(w, node);
+}
+
+static void *
+walk_worker(void *data) {
+	struct WalkWorker *worker = data;
+	struct Walker *w = worker->walker;
+	struct WalkNode *node;
+
+	for (;;) {
+		if ((node = walk_pop(w, worker->id)) != NULL) {
+			walk_dir(w, worker->id, node);
+
+			pthread_mutex_lock(&w->lock);
+			if (--w->pending == 0)
+				pthread_cond_broadcast(&w->cond);
+			pthread_mutex_unlock(&w->lock);
+			continue;
+		}
+
+		pthread_mutex_lock(&w->lock);
+		if (w->pending == 0) {
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		if (w->queued == 0) {
+			w->idle++;
+			pthread_cond_wait(&w->cond, &w->lock);
+			w->idle--;
+		}
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	return NULL;
+}
+
+static int
+walk_thread_count(size_t root_count, int isRecursive) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (cpus < 1)
+		cpus = 1;
+	else if (cpus > WALK_MAX_THREADS)
+		cpus = WALK_MAX_THREADS;
+
+	/* without recursion there is never more work than the roots */
+	if (!isRecursive && (size_t)cpus > root_count)
+		cpus = root_count;
+
+	return cpus;
+}
+
 void
 getDirContents(PyrosList *files, PyrosList *dirs, int isRecursive) {
-	DIR *d;
-	struct dirent *dir;
-	char *new_file;
+	struct Walker w;
+	struct WalkNode **nodes;
+	size_t node_count, node_capacity;
+	size_t root_count = dirs->length;
+	struct WalkNode *node;
+	size_t i, j;
 
-	size_t i;
+	if (root_count == 0)
+		return;
 
-	for (i = 0; i < dirs->length; i++) {
-		d = opendir(dirs->list[i]);
-		if (d) {
-			while ((dir = readdir(d)) != NULL) {
-				// Condition to check regular file.
-				if (dir->d_name[0] == '.' &&
-				    (dir->d_name[1] == '.' ||
-				     dir->d_name[1] == '\0'))
-					continue;
+	memset(&w, 0, sizeof(w));
+	w.isRecursive = isRecursive;
+	w.thread_count = walk_thread_count(root_count, isRecursive);
+	w.queues = calloc(w.thread_count, sizeof(*w.queues));
 
-				new_file = malloc(strlen(dirs->list[i]) +
-				                  strlen(dir->d_name) + 2);
-				if (new_file == NULL) {
-					ERROR(stderr, "Out of memory");
-					exit(1);
-				}
-
-				strcpy(new_file, dirs->list[i]);
-				strcat(new_file, "/");
-				strcat(new_file, dir->d_name);
-
-				if (isFile(new_file)) {
-					Pyros_List_Append(files, new_file);
-				} else if (isDirectory(new_file)) {
-					if (isRecursive)
-						Pyros_List_Append(dirs,
-						                  new_file);
-					else
-						free(new_file);
-				} else {
-					free(new_file);
-				}
-			}
-			closedir(d);
+	node_capacity = root_count;
+	nodes = malloc(sizeof(*nodes) * node_capacity);
+	if (w.queues == NULL || nodes == NULL)
+		walk_oom();
+
+	pthread_mutex_init(&w.lock, NULL);
+	pthread_cond_init(&w.cond, NULL);
+	for (int t = 0; t < w.thread_count; t++)
+		pthread_mutex_init(&w.queues[t].lock, NULL);
+
+	for (i = 0; i < root_count; i++) {
+		nodes[i] = walk_new_node(dirs->list[i]);
+		walk_push(&w, i % w.thread_count, nodes[i]);
+	}
+
+	{
+		pthread_t threads[w.thread_count];
+		struct WalkWorker workers[w.thread_count];
+		int started = 1;
+
+		for (int t = 0; t < w.thread_count; t++) {
+			workers[t].walker = &w;
+			workers[t].id = t;
+		}
+
+		/* the calling thread acts as worker 0, if spawning fails the
+		 * remaining workers simply steal less */
+		for (int t = 1; t < w.thread_count; t++) {
+			if (pthread_create(&threads[t], NULL, &walk_worker,
+			                   &workers[t]))
+				break;
+			started++;
+		}
+
+		walk_worker(&workers[0]);
+
+		for (int t = 1; t < started; t++)
+			pthread_join(threads[t], NULL);
+	}
+
+	/* hand out results breadth first across all roots */
+	node_count = root_count;
+	for (i = 0; i < node_count; i++) {
+		node = nodes[i];
+
+		for (j = 0; j < node->file_count; j++)
+			if (Pyros_List_Append(files, node->files[j]) !=
+			    PYROS_OK)
+				walk_oom();
+
+		if (node_count + node->child_count > node_capacity) {
+			while (node_count + node->child_count > node_capacity)
+				node_capacity *= 2;
+			nodes = realloc(nodes, sizeof(*nodes) * node_capacity);
+			if (nodes == NULL)
+				walk_oom();
 		}
+
+		for (j = 0; j < node->child_count; j++) {
+			if (Pyros_List_Append(dirs, node->children[j]->path) !=
+			    PYROS_OK)
+				walk_oom();
+			nodes[node_count++] = node->children[j];
+		}
+
+		free(node->files);
+		free(node->children);
+		free(node);
+	}
+	free(nodes);
+
+	for (int t = 0; t < w.thread_count; t++) {
+		pthread_mutex_destroy(&w.queues[t].lock);
+		free(w.queues[t].tasks);
 	}
+	free(w.queues);
+	pthread_mutex_destroy(&w.lock);
+	pthread_cond_destroy(&w.cond);
 }
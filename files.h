@@ -7,9 +7,32 @@ int isDirectory(const char *path);
 int isFile(const char *path);
 int pathExists(const char *path);
 
-void cp(const char *src, const char *dst);
+enum COPY_METHOD {
+	COPY_FAILED = -1,
+	COPY_REFLINK,
+	COPY_FILE_RANGE,
+	COPY_SENDFILE,
+	COPY_BUFFER,
+	COPY_HARDLINK,
+	COPY_SYMLINK,
+	COPY_UP_TO_DATE,
+};
 
-void writeListToFile(const PyrosList *list, const char *dst);
+enum LINK_TYPE {
+	LINK_NONE,
+	LINK_HARD,
+	LINK_REFLINK,
+	LINK_SYM,
+	LINK_AUTO,
+};
+
+enum COPY_METHOD cp(const char *src, const char *dst);
+enum COPY_METHOD linkFile(const char *src, const char *dst,
+                          enum LINK_TYPE type);
+const char *copyMethodName(enum COPY_METHOD method);
+
+int writeListToFile(const PyrosList *list, const char *dst);
+int listMatchesFile(const PyrosList *list, const char *dst);
 
 void getFilesFromArgs(PyrosList *other, PyrosList *files, PyrosList *dirs,
                       size_t argc, char **argv);
@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+#include <pyros.h>
+
+#include "hash.h"
+#include "pyros_cli.h"
+#include "stats.h"
+
+#define HASH_BUFFER_SIZE (1 << 20)
+
+extern const char *ExecName;
+
+struct HashJob {
+	const PyrosList *files;
+	char **hashes;
+	const EVP_MD *md;
+	size_t next;
+};
+
+static const EVP_MD *
+get_md(enum PYROS_HASHTYPE hashtype) {
+	switch (hashtype) {
+	case PYROS_MD5HASH:
+		return EVP_md5();
+	case PYROS_SHA1HASH:
+		return EVP_sha1();
+	case PYROS_SHA256HASH:
+		return EVP_sha256();
+	case PYROS_SHA512HASH:
+		return EVP_sha512();
+	case PYROS_BLAKE2SHASH:
+		return EVP_blake2s256();
+	case PYROS_BLAKE2BHASH:
+	default:
+		return EVP_blake2b512();
+	}
+}
+
+static char *
+hash_file(const char *path, const EVP_MD *md, EVP_MD_CTX *ctx,
+          unsigned char *buf) {
+	static const char hex[] = "0123456789abcdef";
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_len;
+	ssize_t read_bytes;
+	size_t total = 0;
+	char *hash;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return NULL;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	if (!EVP_DigestInit_ex(ctx, md, NULL))
+		goto error;
+
+	for (;;) {
+		read_bytes = read(fd, buf, HASH_BUFFER_SIZE);
+		if (read_bytes == 0)
+			break;
+		if (read_bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			goto error;
+		}
+		if (!EVP_DigestUpdate(ctx, buf, read_bytes))
+			goto error;
+		total += read_bytes;
+	}
+	StatsAdd(STATS_BYTES_READ, total);
+
+	if (!EVP_DigestFinal_ex(ctx, digest, &digest_len))
+		goto error;
+	close(fd);
+
+	if ((hash = malloc(digest_len * 2 + 1)) == NULL)
+		return NULL;
+
+	for (unsigned int i = 0; i < digest_len; i++) {
+		hash[i * 2] = hex[digest[i] >> 4];
+		hash[i * 2 + 1] = hex[digest[i] & 0xf];
+	}
+	hash[digest_len * 2] = '\0';
+
+	return hash;
+error:
+	close(fd);
+	return NULL;
+}
+
+static void *
+hash_worker(void *data) {
+	struct HashJob *job = data;
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	unsigned char *buf = malloc(HASH_BUFFER_SIZE);
+	size_t i;
+
+	if (ctx == NULL || buf == NULL) {
+		ERROR(stderr, "Out of memory");
+		exit(1);
+	}
+
+	while ((i = __sync_fetch_and_add(&job->next, 1)) <
+	       job->files->length) {
+		job->hashes[i] =
+		    hash_file(job->files->list[i], job->md, ctx, buf);
+	}
+
+	EVP_MD_CTX_free(ctx);
+	free(buf);
+	return NULL;
+}
+
+/* returns one hex digest per file in files, entries for files that could
+ * not be read are left NULL */
+char **
+hashFiles(const PyrosList *files, enum PYROS_HASHTYPE hashtype, int jobs) {
+	struct HashJob job;
+	pthread_t *threads = malloc(sizeof(*threads) * jobs);
+	int started = 1;
+
+	job.files = files;
+	job.md = get_md(hashtype);
+	job.next = 0;
+	job.hashes = calloc(files->length + 1, sizeof(*job.hashes));
+	if (threads == NULL || job.hashes == NULL) {
+		ERROR(stderr, "Out of memory");
+		exit(1);
+	}
+
+	for (int i = 1; i < jobs; i++) {
+		if (pthread_create(&threads[i], NULL, &hash_worker, &job))
+			break;
+		started++;
+	}
+
+	hash_worker(&job);
+
+	for (int i = 1; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	return job.hashes;
+}
+
+/* hex digest of a single file or NULL if it could not be read */
+char *
+hashFile(const char *path, enum PYROS_HASHTYPE hashtype) {
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	unsigned char *buf = malloc(HASH_BUFFER_SIZE);
+	char *hash;
+
+	if (ctx == NULL || buf == NULL) {
+		ERROR(stderr, "Out of memory");
+		exit(1);
+	}
+
+	hash = hash_file(path, get_md(hashtype), ctx, buf);
+
+	EVP_MD_CTX_free(ctx);
+	free(buf);
+	return hash;
+}
+
+void
+freeHashes(char **hashes, size_t count) {
+	for (size_t i = 0; i < count; i++)
+		free(hashes[i]);
+	free(hashes);
+}
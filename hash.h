@@ -0,0 +1,10 @@
+#ifndef PYROS_CLI_HASH_H
+#define PYROS_CLI_HASH_H
+
+#include "pyros.h"
+
+char **hashFiles(const PyrosList *files, enum PYROS_HASHTYPE hashtype,
+                 int jobs);
+char *hashFile(const char *path, enum PYROS_HASHTYPE hashtype);
+void freeHashes(char **hashes, size_t count);
+#endif
@@ -0,0 +1,252 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "input.h"
+#include "pyros_cli.h"
+
+#define READ_BUFFER_SIZE (1 << 20)
+
+extern const char *ExecName;
+
+/* splits input on newlines (and NULs) or only on NULs, regular files are
+ * mapped and everything else is read in large blocks. All arguments live
+ * in one arena that only grows until it is cleared or freed */
+struct ArgReader {
+	int fd;
+	int nul_delimited;
+	int eof;
+
+	char *map;
+	size_t map_length;
+
+	char *buf;
+	size_t buf_pos;
+	size_t buf_length;
+
+	char *arena;
+	size_t arena_length;
+	size_t arena_capacity;
+	size_t arg_start;
+
+	size_t *offsets;
+	size_t count;
+	size_t capacity;
+	size_t total;
+
+	char **args;
+};
+
+static void
+input_oom() {
+	ERROR(stderr, "Out of memory");
+	exit(1);
+}
+
+ArgReader *
+OpenArgReader(int fd, int nul_delimited) {
+	ArgReader *reader = calloc(1, sizeof(*reader));
+	struct stat statbuf;
+	off_t pos;
+
+	if (reader == NULL)
+		input_oom();
+
+	reader->fd = fd;
+	reader->nul_delimited = nul_delimited;
+
+	if (fstat(fd, &statbuf) == 0 && S_ISREG(statbuf.st_mode) &&
+	    (pos = lseek(fd, 0, SEEK_CUR)) >= 0 && statbuf.st_size > pos) {
+		reader->map = mmap(NULL, statbuf.st_size, PROT_READ,
+		                   MAP_PRIVATE, fd, 0);
+		if (reader->map != MAP_FAILED) {
+			madvise(reader->map, statbuf.st_size,
+			        MADV_SEQUENTIAL);
+			reader->map_length = statbuf.st_size;
+			reader->buf = reader->map;
+			reader->buf_pos = pos;
+			reader->buf_length = statbuf.st_size;
+			reader->eof = TRUE;
+			return reader;
+		}
+		reader->map = NULL;
+	}
+
+	if ((reader->buf = malloc(READ_BUFFER_SIZE)) == NULL)
+		input_oom();
+	return reader;
+}
+
+static int
+fill_buffer(ArgReader *reader) {
+	ssize_t read_bytes;
+
+	if (reader->eof)
+		return FALSE;
+
+	do {
+		read_bytes = read(reader->fd, reader->buf, READ_BUFFER_SIZE);
+	} while (read_bytes < 0 && errno == EINTR);
+
+	if (read_bytes <= 0) {
+		reader->eof = TRUE;
+		return FALSE;
+	}
+
+	reader->buf_pos = 0;
+	reader->buf_length = read_bytes;
+	return TRUE;
+}
+
+static void
+arena_append(ArgReader *reader, const char *data, size_t length) {
+	if (reader->arena_length + length + 1 > reader->arena_capacity) {
+		while (reader->arena_length + length + 1 >
+		       reader->arena_capacity)
+			reader->arena_capacity = reader->arena_capacity
+			                             ? reader->arena_capacity * 2
+			                             : READ_BUFFER_SIZE;
+		reader->arena =
+		    realloc(reader->arena, reader->arena_capacity);
+		if (reader->arena == NULL)
+			input_oom();
+	}
+
+	memcpy(&reader->arena[reader->arena_length], data, length);
+	reader->arena_length += length;
+}
+
+/* copies a piece of an argument, carriage returns are dropped in newline
+ * mode */
+static void
+append_segment(ArgReader *reader, const char *data, size_t length) {
+	const char *cr;
+
+	if (!reader->nul_delimited) {
+		while ((cr = memchr(data, '\r', length)) != NULL) {
+			arena_append(reader, data, cr - data);
+			length -= cr - data + 1;
+			data = cr + 1;
+		}
+	}
+	arena_append(reader, data, length);
+}
+
+/* ends the current argument, empty ones are skipped */
+static int
+finish_arg(ArgReader *reader) {
+	if (reader->arena_length == reader->arg_start)
+		return FALSE;
+
+	if (reader->count >= reader->capacity) {
+		reader->capacity = reader->capacity ? reader->capacity * 2 : 1024;
+		reader->offsets = realloc(
+		    reader->offsets, sizeof(*reader->offsets) * reader->capacity);
+		if (reader->offsets == NULL)
+			input_oom();
+	}
+
+	arena_append(reader, "", 1);
+	reader->offsets[reader->count++] = reader->arg_start;
+	reader->arg_start = reader->arena_length;
+	reader->total++;
+	return TRUE;
+}
+
+/* reads up to max more arguments (everything when max is 0), returns how
+ * many were added */
+size_t
+ReadArgs(ArgReader *reader, size_t max) {
+	size_t added = 0;
+	const char *data;
+	const char *end;
+	size_t length;
+
+	while (max == 0 || added < max) {
+		if (reader->buf_pos >= reader->buf_length &&
+		    !fill_buffer(reader)) {
+			added += finish_arg(reader);
+			break;
+		}
+
+		data = &reader->buf[reader->buf_pos];
+		length = reader->buf_length - reader->buf_pos;
+
+		end = memchr(data, reader->nul_delimited ? '\0' : '\n', length);
+		if (end != NULL)
+			length = end - data;
+		if (!reader->nul_delimited && strnlen(data, length) < length) {
+			length = strnlen(data, length);
+			end = data + length;
+		}
+
+		append_segment(reader, data, length);
+		reader->buf_pos += length;
+
+		if (end != NULL) {
+			reader->buf_pos++;
+			added += finish_arg(reader);
+		}
+	}
+
+	return added;
+}
+
+/* pointers into the arena for every argument read so far, valid until the
+ * next call to ReadArgs or ClearArgs */
+char **
+GetArgs(ArgReader *reader) {
+	reader->args =
+	    realloc(reader->args, sizeof(*reader->args) * (reader->count + 1));
+	if (reader->args == NULL)
+		input_oom();
+
+	for (size_t i = 0; i < reader->count; i++)
+		reader->args[i] = &reader->arena[reader->offsets[i]];
+	reader->args[reader->count] = NULL;
+	return reader->args;
+}
+
+size_t
+GetArgCount(ArgReader *reader) {
+	return reader->count;
+}
+
+/* every argument read so far, including the ones cleared since */
+size_t
+GetTotalArgCount(ArgReader *reader) {
+	return reader->total;
+}
+
+/* forgets the arguments read so far but keeps the memory for the next ones,
+ * a partially read argument is kept */
+void
+ClearArgs(ArgReader *reader) {
+	size_t partial = reader->arena_length - reader->arg_start;
+
+	if (partial > 0)
+		memmove(reader->arena, &reader->arena[reader->arg_start],
+		        partial);
+	reader->arena_length = partial;
+	reader->arg_start = 0;
+	reader->count = 0;
+}
+
+void
+CloseArgReader(ArgReader *reader) {
+	if (reader->map != NULL)
+		munmap(reader->map, reader->map_length);
+	else
+		free(reader->buf);
+
+	free(reader->arena);
+	free(reader->offsets);
+	free(reader->args);
+	free(reader);
+}
@@ -0,0 +1,18 @@
+#ifndef PYROS_CLI_INPUT_H
+#define PYROS_CLI_INPUT_H
+
+#include <stddef.h>
+
+typedef struct ArgReader ArgReader;
+
+ArgReader *OpenArgReader(int fd, int nul_delimited);
+
+size_t ReadArgs(ArgReader *reader, size_t max);
+char **GetArgs(ArgReader *reader);
+size_t GetArgCount(ArgReader *reader);
+size_t GetTotalArgCount(ArgReader *reader);
+void ClearArgs(ArgReader *reader);
+
+void CloseArgReader(ArgReader *reader);
+
+#endif
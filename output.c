@@ -0,0 +1,193 @@
+#define _XOPEN_SOURCE 700
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "output.h"
+#include "pyros_cli.h"
+#include "stats.h"
+
+extern const char *ExecName;
+
+#define OUTPUT_BUFFER_SIZE (256 * 1024)
+/* data at least this long is written straight away instead of being
+ * copied into the buffer */
+#define OUTPUT_DIRECT_SIZE 4096
+#define OUTPUT_MAX_IOV 64
+
+/* short rows are packed into one buffer that is written with writev() once
+ * it fills up, long ones go out together with it right away */
+struct OutputWriter {
+	int fd;
+	char terminator;
+
+	char *buf;
+	size_t buf_length;
+
+	struct iovec iov[OUTPUT_MAX_IOV];
+	int iov_count;
+};
+
+static void
+write_error() {
+	ERROR(stderr, "Unable to write output: %s\n", strerror(errno));
+	exit(1);
+}
+
+OutputWriter *
+NewOutputWriter(int fd, char terminator) {
+	OutputWriter *out = malloc(sizeof(*out));
+
+	if (out == NULL || (out->buf = malloc(OUTPUT_BUFFER_SIZE)) == NULL) {
+		ERROR(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	out->fd = fd;
+	out->terminator = terminator;
+	out->buf_length = 0;
+	out->iov_count = 0;
+
+	/* anything already printed through stdio has to come first */
+	if (fd == STDOUT_FILENO)
+		fflush(stdout);
+
+	return out;
+}
+
+void
+FlushOutput(OutputWriter *out) {
+	struct iovec *iov = out->iov;
+	int count = out->iov_count;
+	ssize_t written;
+
+	StatsStart(STATS_OUTPUT);
+	while (count > 0) {
+		written = writev(out->fd, iov, count);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			write_error();
+		}
+		StatsAdd(STATS_BYTES_WRITTEN, written);
+
+		/* skip past whatever a short write managed to get out */
+		while (count > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	StatsStop(STATS_OUTPUT);
+
+	out->buf_length = 0;
+	out->iov_count = 0;
+}
+
+/* the caller makes sure there is room for another entry */
+static void
+add_iov(OutputWriter *out, const char *data, size_t length) {
+	struct iovec *last;
+
+	/* consecutive data in the buffer shares one entry */
+	if (out->iov_count > 0) {
+		last = &out->iov[out->iov_count - 1];
+		if ((char *)last->iov_base + last->iov_len == data) {
+			last->iov_len += length;
+			return;
+		}
+	}
+
+	out->iov[out->iov_count].iov_base = (char *)data;
+	out->iov[out->iov_count].iov_len = length;
+	out->iov_count++;
+}
+
+static void
+buffer_data(OutputWriter *out, const char *data, size_t length) {
+	char *dest;
+
+	if (out->buf_length + length > OUTPUT_BUFFER_SIZE ||
+	    out->iov_count == OUTPUT_MAX_IOV)
+		FlushOutput(out);
+
+	dest = &out->buf[out->buf_length];
+	memcpy(dest, data, length);
+	out->buf_length += length;
+	add_iov(out, dest, length);
+}
+
+void
+WriteOutput(OutputWriter *out, const char *data, size_t length) {
+	if (length < OUTPUT_DIRECT_SIZE) {
+		buffer_data(out, data, length);
+		return;
+	}
+
+	if (out->iov_count == OUTPUT_MAX_IOV)
+		FlushOutput(out);
+	add_iov(out, data, length);
+	FlushOutput(out);
+}
+
+void
+WriteString(OutputWriter *out, const char *str) {
+	WriteOutput(out, str, strlen(str));
+}
+
+/* str as a quoted JSON string */
+void
+WriteJSONString(OutputWriter *out, const char *str) {
+	char escape[7];
+
+	WriteString(out, "\"");
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\') {
+			escape[0] = '\\';
+			escape[1] = *str;
+			WriteOutput(out, escape, 2);
+		} else if ((unsigned char)*str < 0x20) {
+			sprintf(escape, "\\u%04x", (unsigned char)*str);
+			WriteOutput(out, escape, 6);
+		} else {
+			WriteOutput(out, str, 1);
+		}
+	}
+	WriteString(out, "\"");
+}
+
+/* str as a TSV field, tabs, newlines and backslashes are escaped */
+void
+WriteTSVField(OutputWriter *out, const char *str) {
+	for (; *str != '\0'; str++) {
+		if (*str == '\t')
+			WriteString(out, "\\t");
+		else if (*str == '\n')
+			WriteString(out, "\\n");
+		else if (*str == '\\')
+			WriteString(out, "\\\\");
+		else
+			WriteOutput(out, str, 1);
+	}
+}
+
+void
+WriteRow(OutputWriter *out, const char *row) {
+	WriteOutput(out, row, strlen(row));
+	buffer_data(out, &out->terminator, 1);
+}
+
+void
+CloseOutputWriter(OutputWriter *out) {
+	FlushOutput(out);
+	free(out->buf);
+	free(out);
+}
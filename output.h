@@ -0,0 +1,19 @@
+#ifndef PYROS_CLI_OUTPUT_H
+#define PYROS_CLI_OUTPUT_H
+
+#include <stddef.h>
+
+typedef struct OutputWriter OutputWriter;
+
+OutputWriter *NewOutputWriter(int fd, char terminator);
+
+void WriteOutput(OutputWriter *out, const char *data, size_t length);
+void WriteString(OutputWriter *out, const char *str);
+void WriteJSONString(OutputWriter *out, const char *str);
+void WriteTSVField(OutputWriter *out, const char *str);
+void WriteRow(OutputWriter *out, const char *row);
+
+void FlushOutput(OutputWriter *out);
+void CloseOutputWriter(OutputWriter *out);
+
+#endif
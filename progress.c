@@ -0,0 +1,214 @@
+#define _POSIX_C_SOURCE 200809L
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "progress.h"
+#include "pyros_cli.h"
+
+extern const char *ExecName;
+
+#define PROGRESS_INTERVAL 0.1
+#define PROGRESS_MAX_WIDTH 512
+#define PROGRESS_BAR_WIDTH 20
+
+/* progress is drawn on a single line of stderr, at most every
+ * PROGRESS_INTERVAL seconds and only when stderr is a terminal */
+struct Progress {
+	size_t total;
+	size_t items;
+	size_t bytes;
+
+	int visible;
+	int drawn;
+	struct timespec start;
+	double last_draw;
+
+	struct sigaction old_winch;
+};
+
+static volatile sig_atomic_t resized = TRUE;
+static int width;
+
+static void
+winch_handler(int sig) {
+	UNUSED(sig);
+	resized = TRUE;
+}
+
+static void
+write_terminal(const char *data, size_t length) {
+	/* there is nothing sensible to do if the terminal is gone */
+	if (write(STDERR_FILENO, data, length) < 0)
+		return;
+}
+
+static double
+seconds_since(const struct timespec *since) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) +
+	       (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+static int
+terminal_width() {
+	struct winsize w;
+
+	if (resized) {
+		resized = FALSE;
+		if (ioctl(STDERR_FILENO, TIOCGWINSZ, &w) == 0 && w.ws_col > 0)
+			width = w.ws_col;
+		else
+			width = 80;
+		if (width > PROGRESS_MAX_WIDTH)
+			width = PROGRESS_MAX_WIDTH;
+	}
+	return width;
+}
+
+Progress *
+NewProgress(size_t total) {
+	Progress *progress = calloc(1, sizeof(*progress));
+	struct sigaction sa;
+
+	if (progress == NULL) {
+		ERROR(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	progress->total = total;
+	progress->visible = isatty(STDERR_FILENO);
+	progress->last_draw = -PROGRESS_INTERVAL;
+	clock_gettime(CLOCK_MONOTONIC, &progress->start);
+
+	if (progress->visible) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = &winch_handler;
+		sigemptyset(&sa.sa_mask);
+		sa.sa_flags = SA_RESTART;
+		sigaction(SIGWINCH, &sa, &progress->old_winch);
+		resized = TRUE;
+	}
+
+	return progress;
+}
+
+static void
+format_size(char *buf, size_t size, double value, const char *unit) {
+	static const char prefixes[] = " kMGT";
+	int i = 0;
+
+	while (value >= 1000 && prefixes[i + 1] != '\0') {
+		value /= 1000;
+		i++;
+	}
+	if (i == 0)
+		snprintf(buf, size, "%.0f%s", value, unit);
+	else
+		snprintf(buf, size, "%.1f%c%s", value, prefixes[i], unit);
+}
+
+static void
+draw(Progress *progress, double elapsed, const char *current) {
+	char line[PROGRESS_MAX_WIDTH * 2];
+	char rate[16], throughput[16];
+	int columns = terminal_width();
+	int length = 0;
+	int filled, room;
+	size_t current_length;
+	double per_second = elapsed > 0 ? progress->items / elapsed : 0;
+	long eta;
+
+	format_size(rate, sizeof(rate), per_second, "/s");
+	format_size(throughput, sizeof(throughput),
+	            elapsed > 0 ? progress->bytes / elapsed : 0, "B/s");
+
+	line[length++] = '\r';
+	if (progress->total > 0) {
+		filled = PROGRESS_BAR_WIDTH * progress->items / progress->total;
+		line[length++] = '[';
+		for (int i = 0; i < PROGRESS_BAR_WIDTH; i++)
+			line[length++] = i < filled ? '#' : ' ';
+		length += snprintf(&line[length], sizeof(line) - length,
+		                   "] %3d%% %zu/%zu",
+		                   (int)(100 * progress->items / progress->total),
+		                   progress->items, progress->total);
+	} else {
+		length += snprintf(&line[length], sizeof(line) - length, "%zu",
+		                   progress->items);
+	}
+
+	/* callers that only count items never report bytes */
+	if (progress->bytes > 0)
+		length += snprintf(&line[length], sizeof(line) - length,
+		                   " %s %s", rate, throughput);
+	else
+		length += snprintf(&line[length], sizeof(line) - length,
+		                   " %s", rate);
+
+	if (progress->total > 0 && per_second > 0) {
+		eta = (progress->total - progress->items) / per_second;
+		length += snprintf(&line[length], sizeof(line) - length,
+		                   " ETA %02ld:%02ld:%02ld", eta / 3600,
+		                   eta / 60 % 60, eta % 60);
+	}
+
+	/* show the end of the current name in whatever space is left */
+	room = columns - length - 1;
+	if (current != NULL && room > 4) {
+		current_length = strlen(current);
+		if (current_length > (size_t)room - 1)
+			current += current_length - (room - 1);
+		length += snprintf(&line[length], sizeof(line) - length, " %s",
+		                   current);
+	}
+
+	length += snprintf(&line[length], sizeof(line) - length, "\033[K");
+	write_terminal(line, length);
+	progress->drawn = TRUE;
+}
+
+void
+ProgressAdvance(Progress *progress, size_t items, size_t bytes,
+                const char *current) {
+	double elapsed;
+
+	progress->items += items;
+	progress->bytes += bytes;
+	if (!progress->visible)
+		return;
+
+	elapsed = seconds_since(&progress->start);
+	if (elapsed - progress->last_draw < PROGRESS_INTERVAL)
+		return;
+
+	progress->last_draw = elapsed;
+	draw(progress, elapsed, current);
+}
+
+/* removes the progress line so other output can be printed, it comes back
+ * with the next update */
+void
+ProgressClear(Progress *progress) {
+	if (!progress->visible || !progress->drawn)
+		return;
+
+	write_terminal("\r\033[K", 4);
+	progress->drawn = FALSE;
+}
+
+void
+FinishProgress(Progress *progress) {
+	if (progress->visible) {
+		draw(progress, seconds_since(&progress->start), NULL);
+		write_terminal("\n", 1);
+		sigaction(SIGWINCH, &progress->old_winch, NULL);
+	}
+	free(progress);
+}
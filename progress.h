@@ -0,0 +1,16 @@
+#ifndef PYROS_CLI_PROGRESS_H
+#define PYROS_CLI_PROGRESS_H
+
+#include <stddef.h>
+
+typedef struct Progress Progress;
+
+Progress *NewProgress(size_t total);
+
+void ProgressAdvance(Progress *progress, size_t items, size_t bytes,
+                     const char *current);
+void ProgressClear(Progress *progress);
+
+void FinishProgress(Progress *progress);
+
+#endif
@@ -9,7 +9,9 @@
 
 #include <pyros.h>
 
+#include "input.h"
 #include "pyros_cli.h"
+#include "stats.h"
 
 extern const struct Cmd commands[];
 extern const int command_length;
@@ -20,22 +22,62 @@ char *PDB_PATH = NULL;
 int global_flags = 0;
 int flags = 0;
 
+char *jobs_arg = NULL;
+char *link_arg = NULL;
+char *commit_arg = NULL;
+char *format_arg = NULL;
+char *manifest_arg = NULL;
+char *limit_arg = NULL;
+char *offset_arg = NULL;
+ArgReader *input_reader = NULL;
+
 struct Flag gflags[] = {
     {'h', "help",
      "show general help page or a help page for a specific command", "",
-     GLOBAL_HELP_FLAG                                                                        },
-    {'d', "database", "set database to operate on",                  "<dir>", GLOBAL_DIR_FLAG},
+     GLOBAL_HELP_FLAG, NULL                                                },
+    {'d', "database", "set database to operate on", "<dir>", GLOBAL_DIR_FLAG,
+     NULL                                                                  },
+    {'s', "stats", "print timings and resource usage to stderr as JSON", "",
+     GLOBAL_STATS_FLAG, NULL                                               },
 };
 
 size_t gflags_len = LENGTH(gflags);
 
 struct Flag cmdflags[] = {
     {'H', "show-hash", "List file hases instead of file paths",   "",
-     CMD_HASH_FLAG                                                                     },
+     CMD_HASH_FLAG,      NULL     },
     {'r', "recursive", "recursivly get all files in a directory", "",
-     CMD_RECURSIVE_FLAG                                                                },
-    {'i', "input",     "read input from stdin",                   "", CMD_INPUT_FLAG   },
-    {'p', "progress",  "show progress",                           "", CMD_PROGRESS_FLAG},
+     CMD_RECURSIVE_FLAG, NULL     },
+    {'i', "input",     "read input from stdin",                   "",
+     CMD_INPUT_FLAG,     NULL     },
+    {'p', "progress",  "show progress",                           "",
+     CMD_PROGRESS_FLAG,  NULL     },
+    {'j', "jobs",      "number of worker threads",                "<n>",
+     CMD_JOBS_FLAG,      &jobs_arg},
+    {'l', "link",      "link files instead of copying them (hard|reflink|sym|auto)",
+     "<type>", CMD_LINK_FLAG, &link_arg},
+    {'n', "commit-every", "commit after every <n> commands or files", "<n>",
+     CMD_COMMIT_FLAG, &commit_arg},
+    {'0', "null",      "use NUL instead of newline in input and output", "",
+     CMD_NUL_FLAG,       NULL     },
+    {'f', "format",    "output format (tree|json|dot|tsv)",      "<fmt>",
+     CMD_FORMAT_FLAG,    &format_arg},
+    {'S', "sync",      "skip files whose size and mtime already match", "",
+     CMD_SYNC_FLAG,      NULL     },
+    {'c', "checksum",  "like --sync but compare file contents",  "",
+     CMD_CHECKSUM_FLAG,  NULL     },
+    {'D', "delete",    "delete earlier exports no longer matching", "",
+     CMD_DELETE_FLAG,    NULL     },
+    {'m', "manifest",  "write one manifest instead of .txt files (jsonl|tsv)",
+     "<fmt>", CMD_MANIFEST_FLAG, &manifest_arg},
+    {'L', "limit",     "print at most <n> results",              "<n>",
+     CMD_LIMIT_FLAG,     &limit_arg},
+    {'O', "offset",    "skip the first <n> results",             "<n>",
+     CMD_OFFSET_FLAG,    &offset_arg},
+    {'C', "count",     "print only the number of results",       "",
+     CMD_COUNT_FLAG,     NULL     },
+    {'w', "warn",      "warn about unknown tags and suggest close ones", "",
+     CMD_WARN_FLAG,      NULL     },
 };
 
 static const struct Cmd *
@@ -93,6 +135,7 @@ error_oom:
 static void
 help(const struct Cmd *cmd) {
 
+	before_help();
 	if (cmd == NULL) {
 		commands[0].func(0, NULL);
 	} else {
@@ -106,7 +149,7 @@ help(const struct Cmd *cmd) {
 			printf("\nOPTIONS:\n");
 			for (size_t i = 0; i < LENGTH(cmdflags); i++) {
 				if (cmd->supported_flags & cmdflags[i].value)
-					printf("  -%c --%-10s %-5s%s\n",
+					printf("  -%c --%-10s %-7s %s\n",
 					       cmdflags[i].shortName,
 					       cmdflags[i].longName,
 					       cmdflags[i].usage,
@@ -145,13 +188,22 @@ error_oom:
 
 static char
 cmp_short_flags(struct Flag *flags, int flag_count, int *set_flags,
-                char *text) {
+                char ***pending_arg, char *text) {
 	int length = strlen(text);
 	for (int i = 0; i < length; i++) {
 		for (int j = 0; j < flag_count; j++) {
 			if (text[i] == flags[j].shortName) {
 				(*set_flags) |= flags[j].value;
-				goto next;
+				if (flags[j].arg == NULL)
+					goto next;
+
+				/* value is either attached (-j4) or the next
+				 * argument (-j 4) */
+				if (text[i + 1] != '\0')
+					*flags[j].arg = &text[i + 1];
+				else
+					*pending_arg = flags[j].arg;
+				return '\0';
 			}
 		}
 		return text[i];
@@ -161,18 +213,31 @@ cmp_short_flags(struct Flag *flags, int flag_count, int *set_flags,
 }
 
 static int
-cmp_long_flags(struct Flag *flags, int flag_count, int *set_flags, char *text) {
+cmp_long_flags(struct Flag *flags, int flag_count, int *set_flags,
+               char ***pending_arg, char *text) {
+	char *value = strchr(text, '=');
+	size_t name_len = value ? (size_t)(value - text) : strlen(text);
+
 	for (int i = 0; i < flag_count; i++) {
-		if (!strcmp(text, flags[i].longName)) {
-			(*set_flags) |= flags[i].value;
-			return TRUE;
-		}
+		if (strncmp(text, flags[i].longName, name_len) ||
+		    flags[i].longName[name_len] != '\0')
+			continue;
+
+		if (flags[i].arg == NULL && value != NULL)
+			return FALSE;
+
+		(*set_flags) |= flags[i].value;
+		if (value != NULL)
+			*flags[i].arg = value + 1;
+		else if (flags[i].arg != NULL)
+			*pending_arg = flags[i].arg;
+		return TRUE;
 	}
 	return FALSE;
 }
 
 static void
-check_arg_count(int arg_count, const struct Cmd *cmd) {
+check_max_arg_count(int arg_count, const struct Cmd *cmd) {
 	if (cmd->maxArgs != -1 && arg_count > cmd->maxArgs) {
 		ERROR(stderr,
 		      "command \"%s\""
@@ -180,7 +245,13 @@ check_arg_count(int arg_count, const struct Cmd *cmd) {
 		      cmd->longName, cmd->maxArgs,
 		      (cmd->maxArgs < 2) ? '\0' : 's', arg_count);
 		exit(1);
-	} else if (arg_count < cmd->minArgs) {
+	}
+}
+
+static void
+check_arg_count(int arg_count, const struct Cmd *cmd) {
+	check_max_arg_count(arg_count, cmd);
+	if (arg_count < cmd->minArgs) {
 		ERROR(stderr,
 		      "command \"%s\""
 		      " requires at least %d argument%c %d given\n",
@@ -190,80 +261,24 @@ check_arg_count(int arg_count, const struct Cmd *cmd) {
 	}
 }
 
-static PyrosList *
-get_args_from_stdin(int cmd_arg_count, char *cmd_args[]) {
-	PyrosList *arguments = Pyros_Create_List(cmd_arg_count);
-	int arg_capacity = 100;
-	char *arg = malloc(arg_capacity);
-	char *old_arg;
-	int cur_pos = 0;
-	int ch;
-
-	if (arguments == NULL || arg == NULL)
-		goto error_oom;
-
-	for (int i = 0; i < cmd_arg_count; i++) {
-		old_arg = malloc(strlen(cmd_args[i]) + 1);
-		if (old_arg == NULL)
-			goto error_oom;
-		strcpy(old_arg, cmd_args[i]);
-		if (Pyros_List_Append(arguments, old_arg) != PYROS_OK)
-			goto error_oom;
-	}
-
-	while ((ch = fgetc(stdin)) != EOF) {
-		switch (ch) {
-		case '\r':
-			continue;
-		case '\n':
-		case '\0':
-			if (cur_pos != 0) {
-				arg[cur_pos] = '\0';
-				if (Pyros_List_Append(arguments, arg) !=
-				    PYROS_OK)
-					goto error_oom;
-				arg = malloc(arg_capacity);
-				if (arg == NULL)
-					goto error_oom;
-			}
-			cur_pos = 0;
-			break;
-		default:
-			arg[cur_pos] = ch;
-			cur_pos++;
-			if (arg_capacity <= cur_pos) {
-				arg_capacity *= 2;
-				arg = realloc(arg, arg_capacity);
-				if (arg == NULL)
-					goto error_oom;
-			}
-			break;
-		}
-	}
-
-	if (cur_pos > 0) {
-		arg[cur_pos] = '\0';
-		if (Pyros_List_Append(arguments, arg) != PYROS_OK)
-			goto error_oom;
-	} else {
-		free(arg);
-	}
-
-	return arguments;
-error_oom:
-	ERROR(stderr, "Out of memory");
-	exit(1);
-}
-
-static void
+void
 parse_input(int argc, char *argv[]) {
 
 	const struct Cmd *cmd = NULL;
-	char *cmd_args[argc];
+	char **cmd_args;
 	int cmd_arg_count = 0;
+	char **pending_arg = NULL;
 
 	int ignore_flags = FALSE;
 
+	/* may be called again for every line of a batch, whose lines have no
+	 * argv size limit, so this isn't on the stack */
+	flags = 0;
+	if ((cmd_args = malloc(sizeof(*cmd_args) * argc)) == NULL) {
+		ERROR(stderr, "Out of memory\n");
+		exit(1);
+	}
+
 	for (int i = 1; i < argc; i++) {
 		if (global_flags & GLOBAL_DIR_FLAG) {
 			set_dir(argv[i]);
@@ -271,17 +286,24 @@ parse_input(int argc, char *argv[]) {
 			continue;
 		}
 
+		if (pending_arg != NULL) {
+			*pending_arg = argv[i];
+			pending_arg = NULL;
+			continue;
+		}
+
 		/* check for flags */
 		if (!ignore_flags && argv[i][0] == '-') {
 			if (argv[i][1] == '-') {
 				if (argv[i][2] == '\0') {
 					ignore_flags = TRUE;
 				} else if (cmp_long_flags(
-				               cmdflags, LENGTH(cmdflags),
-				               &flags, &argv[i][2])) {
-				} else if (cmp_long_flags(
-				               gflags, LENGTH(gflags),
-				               &global_flags, &argv[i][2])) {
+				               cmdflags, LENGTH(cmdflags), &flags,
+				               &pending_arg, &argv[i][2])) {
+				} else if (cmp_long_flags(gflags, LENGTH(gflags),
+				                          &global_flags,
+				                          &pending_arg,
+				                          &argv[i][2])) {
 				} else {
 					ERROR(stderr, "Unknown option \"%s\"\n",
 					      argv[i]);
@@ -290,12 +312,12 @@ parse_input(int argc, char *argv[]) {
 			} else {
 				char last_char;
 				if (cmp_short_flags(cmdflags, LENGTH(cmdflags),
-				                    &flags,
+				                    &flags, &pending_arg,
 				                    &argv[i][1]) == '\0') {
 				} else if ((last_char = cmp_short_flags(
 				                gflags, LENGTH(gflags),
-				                &global_flags, &argv[i][1])) ==
-				           '\0') {
+				                &global_flags, &pending_arg,
+				                &argv[i][1])) == '\0') {
 				} else {
 					ERROR(stderr,
 					      "Unknown option \"-%c\"\n",
@@ -326,6 +348,12 @@ parse_input(int argc, char *argv[]) {
 	if (global_flags & GLOBAL_HELP_FLAG)
 		help(cmd);
 
+	if (pending_arg != NULL) {
+		ERROR(stderr, "option \"%s\" requires an argument\n",
+		      argv[argc - 1]);
+		exit(1);
+	}
+
 	if (cmd == NULL) {
 		ERROR(stderr, "No command given\n");
 		exit(1);
@@ -343,21 +371,60 @@ parse_input(int argc, char *argv[]) {
 		}
 	}
 
+	if (global_flags & GLOBAL_STATS_FLAG)
+		EnableStats();
+
 	if (PDB_PATH == NULL)
 		get_database_path();
 
-	if (flags & CMD_INPUT_FLAG) {
-		PyrosList *stdin_args =
-		    get_args_from_stdin(cmd_arg_count, cmd_args);
+	before_command(cmd, argc, argv);
+
+	if ((flags & CMD_INPUT_FLAG) && (flags & CMD_COMMIT_FLAG)) {
+		/* stream stdin, the command pulls its arguments in batches.
+		 * stdin only adds to them, so too many are caught before the
+		 * stream starts and too few once it is drained */
+		check_max_arg_count(cmd_arg_count, cmd);
+		input_reader =
+		    OpenArgReader(STDIN_FILENO, flags & CMD_NUL_FLAG);
+		cmd->func(cmd_arg_count, cmd_args);
+		check_arg_count(cmd_arg_count + GetTotalArgCount(input_reader),
+		                cmd);
+		CloseArgReader(input_reader);
+		input_reader = NULL;
+		after_command(cmd);
+	} else if (flags & CMD_INPUT_FLAG) {
+		ArgReader *reader;
+		size_t stdin_arg_count;
+		char **args;
+
+		StatsStart(STATS_INPUT);
+		reader = OpenArgReader(STDIN_FILENO, flags & CMD_NUL_FLAG);
+		stdin_arg_count = ReadArgs(reader, 0);
+		args =
+		    malloc(sizeof(*args) * (cmd_arg_count + stdin_arg_count + 1));
+		StatsStop(STATS_INPUT);
+
+		if (args == NULL) {
+			ERROR(stderr, "Out of memory");
+			exit(1);
+		}
+
+		memcpy(args, cmd_args, sizeof(*args) * cmd_arg_count);
+		memcpy(&args[cmd_arg_count], GetArgs(reader),
+		       sizeof(*args) * (stdin_arg_count + 1));
 
-		check_arg_count(stdin_args->length, cmd);
-		cmd->func(stdin_args->length, (char **)stdin_args->list);
+		check_arg_count(cmd_arg_count + stdin_arg_count, cmd);
+		cmd->func(cmd_arg_count + stdin_arg_count, args);
 
-		Pyros_List_Free(stdin_args, free);
+		free(args);
+		CloseArgReader(reader);
+		after_command(cmd);
 	} else {
 		check_arg_count(cmd_arg_count, cmd);
 		cmd->func(cmd_arg_count, cmd_args);
+		after_command(cmd);
 	}
+	free(cmd_args);
 }
 
 int
@@ -17,6 +17,7 @@ typedef void (*Command)(int argc, char **argv);
 enum GLOBAL_FLAGS {
 	GLOBAL_HELP_FLAG = 1,
 	GLOBAL_DIR_FLAG = 2,
+	GLOBAL_STATS_FLAG = 4,
 };
 
 enum COMMAND_FLAGS {
@@ -24,6 +25,19 @@ enum COMMAND_FLAGS {
 	CMD_RECURSIVE_FLAG = 2,
 	CMD_INPUT_FLAG = 4,
 	CMD_PROGRESS_FLAG = 8,
+	CMD_JOBS_FLAG = 16,
+	CMD_LINK_FLAG = 32,
+	CMD_COMMIT_FLAG = 64,
+	CMD_NUL_FLAG = 128,
+	CMD_FORMAT_FLAG = 256,
+	CMD_SYNC_FLAG = 512,
+	CMD_CHECKSUM_FLAG = 1024,
+	CMD_DELETE_FLAG = 2048,
+	CMD_MANIFEST_FLAG = 4096,
+	CMD_LIMIT_FLAG = 8192,
+	CMD_OFFSET_FLAG = 16384,
+	CMD_COUNT_FLAG = 32768,
+	CMD_WARN_FLAG = 65536,
 };
 
 struct Flag {
@@ -32,6 +46,7 @@ struct Flag {
 	const char *desc;
 	const char *usage;
 	int value;
+	char **arg;
 };
 
 struct Cmd {
@@ -46,4 +61,8 @@ struct Cmd {
 };
 
 void print_error(char *, const void *);
+void parse_input(int argc, char *argv[]);
+void before_command(const struct Cmd *cmd, int argc, char **argv);
+void before_help();
+void after_command(const struct Cmd *cmd);
 #endif
@@ -0,0 +1,92 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "pyros_cli.h"
+#include "stats.h"
+
+static const char *phase_names[STATS_PHASE_COUNT] = {
+    "open", "input", "walk", "hash", "import",
+    "query", "copy",  "commit", "output",
+};
+
+static const char *counter_names[STATS_COUNTER_COUNT] = {
+    "files", "bytes_read", "bytes_copied", "bytes_written", "db_calls",
+};
+
+/* phases are only timed from the main thread, counters may be bumped by
+ * workers too */
+static int enabled = FALSE;
+static struct timespec started;
+static struct timespec phase_start[STATS_PHASE_COUNT];
+static double phase_time[STATS_PHASE_COUNT];
+static size_t counters[STATS_COUNTER_COUNT];
+
+static double
+elapsed(const struct timespec *since) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) +
+	       (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+static double
+timeval_seconds(const struct timeval *tv) {
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+void
+EnableStats() {
+	if (enabled)
+		return;
+
+	enabled = TRUE;
+	clock_gettime(CLOCK_MONOTONIC, &started);
+}
+
+void
+StatsStart(enum STATS_PHASE phase) {
+	if (enabled)
+		clock_gettime(CLOCK_MONOTONIC, &phase_start[phase]);
+}
+
+void
+StatsStop(enum STATS_PHASE phase) {
+	if (enabled)
+		phase_time[phase] += elapsed(&phase_start[phase]);
+}
+
+void
+StatsAdd(enum STATS_COUNTER counter, size_t amount) {
+	if (enabled)
+		__sync_fetch_and_add(&counters[counter], amount);
+}
+
+void
+PrintStats(const char *command) {
+	struct rusage usage;
+	int i;
+
+	if (!enabled)
+		return;
+
+	getrusage(RUSAGE_SELF, &usage);
+
+	fprintf(stderr, "{\"command\":\"%s\",\"seconds\":%.6f,\"phases\":{",
+	        command, elapsed(&started));
+	for (i = 0; i < STATS_PHASE_COUNT; i++)
+		fprintf(stderr, "%s\"%s\":%.6f", i > 0 ? "," : "",
+		        phase_names[i], phase_time[i]);
+	fprintf(stderr, "}");
+
+	for (i = 0; i < STATS_COUNTER_COUNT; i++)
+		fprintf(stderr, ",\"%s\":%zu", counter_names[i], counters[i]);
+
+	fprintf(stderr,
+	        ",\"user_seconds\":%.6f,\"sys_seconds\":%.6f,"
+	        "\"max_rss_kb\":%ld}\n",
+	        timeval_seconds(&usage.ru_utime),
+	        timeval_seconds(&usage.ru_stime), usage.ru_maxrss);
+}
@@ -0,0 +1,36 @@
+#ifndef PYROS_CLI_STATS_H
+#define PYROS_CLI_STATS_H
+
+#include <stddef.h>
+
+enum STATS_PHASE {
+	STATS_OPEN,
+	STATS_INPUT,
+	STATS_WALK,
+	STATS_HASH,
+	STATS_IMPORT,
+	STATS_QUERY,
+	STATS_COPY,
+	STATS_COMMIT,
+	STATS_OUTPUT,
+	STATS_PHASE_COUNT
+};
+
+enum STATS_COUNTER {
+	STATS_FILES,
+	STATS_BYTES_READ,
+	STATS_BYTES_COPIED,
+	STATS_BYTES_WRITTEN,
+	STATS_DB_CALLS,
+	STATS_COUNTER_COUNT
+};
+
+void EnableStats();
+
+void StatsStart(enum STATS_PHASE phase);
+void StatsStop(enum STATS_PHASE phase);
+void StatsAdd(enum STATS_COUNTER counter, size_t amount);
+
+void PrintStats(const char *command);
+
+#endif
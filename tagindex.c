@@ -0,0 +1,546 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <pyros.h>
+
+#include "cache.h"
+#include "pyros_cli.h"
+#include "stats.h"
+#include "tagindex.h"
+
+#define INDEX_NAME "tags.idx"
+#define INDEX_MAGIC "PYRTI03"
+/* jaccard similarity of the trigram sets below which tags aren't
+ * suggested, the same cut off pg_trgm uses */
+#define SUGGEST_THRESHOLD 0.3
+
+/* the header, an entry for every tag in strcmp order, the trigrams in
+ * key order, their posting lists of tag ids and then the tag names.
+ * it only holds what Pyros_Get_All_Tags returns so rebuilding it is a
+ * single query */
+struct IndexHeader {
+	char magic[8];
+	struct CacheStamp stamp;
+	uint64_t count;
+	uint64_t trigram_count;
+	uint64_t posting_count;
+	uint64_t data_length;
+};
+
+struct IndexEntry {
+	uint64_t name;
+	uint32_t trigrams;
+	uint32_t padding;
+};
+
+/* postings of a trigram run up to the start of the next one */
+struct IndexTrigram {
+	uint32_t key;
+	uint32_t start;
+};
+
+struct TagIndex {
+	void *base;
+	size_t length;
+	int mapped;
+
+	const struct IndexEntry *entries;
+	size_t count;
+	const struct IndexTrigram *trigrams;
+	size_t trigram_count;
+	const uint32_t *postings;
+	size_t posting_count;
+	const char *data;
+	size_t data_length;
+};
+
+extern const char *ExecName;
+
+/* points section at the next size * count bytes of the index, FALSE if
+ * they run past its end */
+static int
+take_section(const char *base, size_t length, size_t *offset, size_t size,
+             uint64_t count, const void **section) {
+	if (count > (length - *offset) / size)
+		return FALSE;
+
+	*section = base + *offset;
+	*offset += size * count;
+	return TRUE;
+}
+
+static TagIndex *
+new_index(void *base, size_t length, int mapped) {
+	const struct IndexHeader *header = base;
+	TagIndex *index;
+	size_t offset = sizeof(*header);
+
+	if ((index = calloc(1, sizeof(*index))) == NULL) {
+		ERROR(stderr, "Out of memory\n");
+		exit(1);
+	}
+	index->base = base;
+	index->length = length;
+	index->mapped = mapped;
+
+	if (!take_section(base, length, &offset, sizeof(struct IndexEntry),
+	                  header->count, (const void **)&index->entries) ||
+	    !take_section(base, length, &offset, sizeof(struct IndexTrigram),
+	                  header->trigram_count,
+	                  (const void **)&index->trigrams) ||
+	    !take_section(base, length, &offset, sizeof(uint32_t),
+	                  header->posting_count,
+	                  (const void **)&index->postings)) {
+		CloseTagIndex(index);
+		return NULL;
+	}
+
+	index->count = header->count;
+	index->trigram_count = header->trigram_count;
+	index->posting_count = header->posting_count;
+	index->data = (const char *)base + offset;
+	index->data_length = length - offset;
+
+	if (header->data_length != index->data_length ||
+	    (index->count > 0 &&
+	     (index->data_length == 0 ||
+	      index->data[index->data_length - 1] != '\0'))) {
+		CloseTagIndex(index);
+		return NULL;
+	}
+	return index;
+}
+
+/* NULL when there is no index or the database changed since it was
+ * built */
+TagIndex *
+OpenTagIndex(const char *db_path) {
+	struct CacheStamp stamp;
+	char *path;
+	void *base;
+	size_t length;
+
+	if ((path = GetCacheStamp(db_path, INDEX_NAME, &stamp)) == NULL)
+		return NULL;
+
+	base = MapCacheFile(path, INDEX_MAGIC, &stamp,
+	                    sizeof(struct IndexHeader), &length);
+	free(path);
+	if (base == NULL)
+		return NULL;
+
+	return new_index(base, length, TRUE);
+}
+
+/* like OpenTagIndex but also returns an index built before the last
+ * change to the database, stale tells which one it is */
+TagIndex *
+OpenStaleTagIndex(const char *db_path, int *stale) {
+	struct CacheStamp stamp;
+	char *path;
+	void *base;
+	size_t length;
+
+	if ((path = GetCacheStamp(db_path, INDEX_NAME, &stamp)) == NULL)
+		return NULL;
+
+	base = MapCacheFile(path, INDEX_MAGIC, NULL,
+	                    sizeof(struct IndexHeader), &length);
+	free(path);
+	if (base == NULL)
+		return NULL;
+
+	*stale = memcmp(&((struct IndexHeader *)base)->stamp, &stamp,
+	                sizeof(stamp)) != 0;
+	return new_index(base, length, TRUE);
+}
+
+static int
+compare_names(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int
+compare_keys(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static int
+compare_pairs(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/* the distinct trigrams of tag, lowercased and padded with two spaces in
+ * front and one behind so short tags and word starts get some too, keys
+ * needs room for strlen(tag) + 1 of them */
+static size_t
+tag_trigrams(const char *tag, uint32_t *keys) {
+	size_t length = strlen(tag);
+	uint32_t key = (' ' << 8) | ' ';
+	size_t i, count;
+
+	for (i = 0; i <= length; i++) {
+		unsigned char c = i < length ? tolower((unsigned char)tag[i]) : ' ';
+		key = ((key << 8) | c) & 0xffffff;
+		keys[i] = key;
+	}
+
+	qsort(keys, length + 1, sizeof(*keys), &compare_keys);
+	for (count = 0, i = 0; i <= length; i++) {
+		if (count == 0 || keys[i] != keys[count - 1])
+			keys[count++] = keys[i];
+	}
+	return count;
+}
+
+/* trigram and tag id pairs of every tag sorted by trigram, the trigram
+ * count of every tag goes to counts */
+static size_t
+collect_trigrams(char **names, size_t count, size_t longest,
+                 size_t data_length, uint64_t **pairs, uint16_t *counts) {
+	uint32_t *keys = malloc(sizeof(*keys) * (longest + 1));
+	size_t i, j, n, total = 0;
+
+	/* a tag never has more trigrams than bytes in its name */
+	*pairs = malloc(sizeof(**pairs) * (data_length + 1));
+	if (keys == NULL || *pairs == NULL) {
+		ERROR(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	for (i = 0; i < count; i++) {
+		n = tag_trigrams(names[i], keys);
+		counts[i] = n > UINT16_MAX ? UINT16_MAX : n;
+		for (j = 0; j < n; j++)
+			(*pairs)[total++] = (uint64_t)keys[j] << 32 | i;
+	}
+	free(keys);
+
+	qsort(*pairs, total, sizeof(**pairs), &compare_pairs);
+	return total;
+}
+
+/* builds the index from the database and saves it for the next caller,
+ * NULL if a query fails */
+TagIndex *
+BuildTagIndex(const char *db_path, PyrosDB *pyrosDB) {
+	struct CacheStamp stamp;
+	struct IndexHeader *header;
+	struct IndexEntry *entries;
+	struct IndexTrigram *trigrams;
+	PyrosList *tags;
+	char **names;
+	uint16_t *counts;
+	uint64_t *pairs;
+	uint32_t *postings;
+	size_t count, i, length, data_length = 0, longest = 0;
+	size_t pair_count, trigram_count;
+	uint64_t offset;
+	char *base, *data, *path, *tmp;
+	FILE *fp;
+
+	/* stamp before reading so a write racing the build only makes the
+	 * saved index stale */
+	path = GetCacheStamp(db_path, INDEX_NAME, &stamp);
+
+	StatsStart(STATS_QUERY);
+	StatsAdd(STATS_DB_CALLS, 1);
+	tags = Pyros_Get_All_Tags(pyrosDB);
+	StatsStop(STATS_QUERY);
+	if (tags == NULL) {
+		free(path);
+		return NULL;
+	}
+
+	names = (char **)tags->list;
+	count = tags->length;
+	qsort(names, count, sizeof(*names), &compare_names);
+
+	for (i = 0; i < count; i++) {
+		length = strlen(names[i]);
+		data_length += length + 1;
+		if (length > longest)
+			longest = length;
+	}
+
+	if ((counts = malloc(sizeof(*counts) * (count + 1))) == NULL) {
+		ERROR(stderr, "Out of memory\n");
+		exit(1);
+	}
+	pair_count = collect_trigrams(names, count, longest, data_length, &pairs,
+	                              counts);
+	for (trigram_count = 0, i = 0; i < pair_count; i++) {
+		if (i == 0 || pairs[i] >> 32 != pairs[i - 1] >> 32)
+			trigram_count++;
+	}
+
+	length = sizeof(*header) + count * sizeof(*entries) +
+	         trigram_count * sizeof(*trigrams) +
+	         pair_count * sizeof(*postings) + data_length;
+	if ((base = calloc(1, length)) == NULL) {
+		ERROR(stderr, "Out of memory\n");
+		exit(1);
+	}
+	header = (struct IndexHeader *)base;
+	entries = (struct IndexEntry *)(header + 1);
+	trigrams = (struct IndexTrigram *)(entries + count);
+	postings = (uint32_t *)(trigrams + trigram_count);
+	data = (char *)(postings + pair_count);
+
+	memcpy(header->magic, INDEX_MAGIC, sizeof(header->magic));
+	header->stamp = stamp;
+	header->count = count;
+	header->trigram_count = trigram_count;
+	header->posting_count = pair_count;
+	header->data_length = data_length;
+
+	for (offset = 0, i = 0; i < count; i++) {
+		entries[i].name = offset;
+		entries[i].trigrams = counts[i];
+		strcpy(&data[offset], names[i]);
+		offset += strlen(names[i]) + 1;
+	}
+
+	for (trigram_count = 0, i = 0; i < pair_count; i++) {
+		if (i == 0 || pairs[i] >> 32 != pairs[i - 1] >> 32) {
+			trigrams[trigram_count].key = pairs[i] >> 32;
+			trigrams[trigram_count].start = i;
+			trigram_count++;
+		}
+		postings[i] = (uint32_t)pairs[i];
+	}
+
+	Pyros_List_Free(tags, free);
+	free(counts);
+	free(pairs);
+
+	if (path != NULL && (fp = CreateCacheFile(path, &tmp)) != NULL) {
+		fwrite(base, 1, length, fp);
+		FinishCacheFile(fp, tmp, path);
+	}
+	free(path);
+
+	return new_index(base, length, FALSE);
+}
+
+const char *
+TagIndexName(TagIndex *index, size_t i) {
+	uint64_t name = index->entries[i].name;
+
+	/* only a damaged file points past its names */
+	if (name >= index->data_length)
+		return &index->data[index->data_length - 1];
+	return &index->data[name];
+}
+
+/* returns the first tag starting with prefix and sets end to one past the
+ * last one */
+size_t
+FindTagPrefix(TagIndex *index, const char *prefix, size_t *end) {
+	size_t length = strlen(prefix);
+	size_t low = 0, high = index->count, mid, start;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (strcmp(TagIndexName(index, mid), prefix) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	start = low;
+	high = index->count;
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (strncmp(TagIndexName(index, mid), prefix, length) <= 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	*end = low;
+	return start;
+}
+
+int
+TagIndexContains(TagIndex *index, const char *tag) {
+	size_t end;
+	size_t i = FindTagPrefix(index, tag, &end);
+
+	return i < end && !strcmp(TagIndexName(index, i), tag);
+}
+
+/* posting list of a trigram, empty if no tag has it */
+static const uint32_t *
+find_postings(TagIndex *index, uint32_t key, const uint32_t **end) {
+	size_t low = 0, high = index->trigram_count, mid, start, stop;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (index->trigrams[mid].key < key)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	*end = index->postings;
+	if (low == index->trigram_count || index->trigrams[low].key != key)
+		return index->postings;
+
+	start = index->trigrams[low].start;
+	stop = low + 1 < index->trigram_count ? index->trigrams[low + 1].start
+	                                       : index->posting_count;
+	if (start > stop || stop > index->posting_count)
+		return index->postings;
+
+	*end = &index->postings[stop];
+	return &index->postings[start];
+}
+
+/* keeps the best max suggestions in suggestions, ordered by score and then
+ * by name */
+static size_t
+rank_suggestion(struct TagSuggestion *suggestions, size_t found, size_t max,
+                size_t tag, double score) {
+	size_t i = found < max ? found++ : max;
+
+	while (i > 0 && (suggestions[i - 1].score < score ||
+	                 (suggestions[i - 1].score == score &&
+	                  suggestions[i - 1].tag > tag))) {
+		if (i < max)
+			suggestions[i] = suggestions[i - 1];
+		i--;
+	}
+
+	if (i < max) {
+		suggestions[i].tag = tag;
+		suggestions[i].score = score;
+	}
+	return found;
+}
+
+struct PostingList {
+	const uint32_t *start;
+	const uint32_t *end;
+};
+
+static int
+compare_lists(const void *a, const void *b) {
+	const struct PostingList *x = a;
+	const struct PostingList *y = b;
+	ptrdiff_t diff = (x->end - x->start) - (y->end - y->start);
+	return (diff > 0) - (diff < 0);
+}
+
+/* whether a tag with tag_count trigrams could still make the threshold
+ * if it shared at most shared of the query's query_count */
+static int
+reachable(size_t shared, size_t query_count, size_t tag_count) {
+	if (shared > tag_count)
+		shared = tag_count;
+	return shared >= SUGGEST_THRESHOLD * (query_count + tag_count - shared);
+}
+
+/* the max tags sharing the most trigrams with tag, scored by the jaccard
+ * similarity of their trigram sets.
+ * a tag above the threshold shares at least need of the query's trigrams,
+ * so it has to be in one of the key_count - need + 1 shortest posting
+ * lists. only those are walked, the long ones are binary searched for
+ * the candidates that can still make it */
+size_t
+SuggestTags(TagIndex *index, const char *tag,
+            struct TagSuggestion *suggestions, size_t max) {
+	uint32_t *keys = malloc(sizeof(*keys) * (strlen(tag) + 1));
+	struct PostingList *lists = malloc(sizeof(*lists) * (strlen(tag) + 1));
+	uint16_t *shared = calloc(index->count + 1, sizeof(*shared));
+	size_t *touched = NULL;
+	size_t touched_count = 0, touched_size = 0;
+	const uint32_t *posting;
+	size_t key_count, need, i, j, kept, found = 0;
+	uint32_t id;
+	double score;
+
+	if (keys == NULL || lists == NULL || shared == NULL) {
+		ERROR(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	key_count = tag_trigrams(tag, keys);
+	for (i = 0; i < key_count; i++)
+		lists[i].start = find_postings(index, keys[i], &lists[i].end);
+	qsort(lists, key_count, sizeof(*lists), &compare_lists);
+
+	need = SUGGEST_THRESHOLD * key_count;
+	if (need < SUGGEST_THRESHOLD * key_count || need == 0)
+		need++;
+
+	for (i = 0; i < key_count - need + 1; i++) {
+		for (posting = lists[i].start; posting < lists[i].end;
+		     posting++) {
+			if (*posting >= index->count || shared[*posting]++ > 0)
+				continue;
+
+			if (touched_count == touched_size) {
+				touched_size = touched_size * 2 + 64;
+				touched = realloc(touched,
+				                  sizeof(*touched) * touched_size);
+				if (touched == NULL) {
+					ERROR(stderr, "Out of memory\n");
+					exit(1);
+				}
+			}
+			touched[touched_count++] = *posting;
+		}
+	}
+
+	for (; i < key_count; i++) {
+		for (kept = 0, j = 0; j < touched_count; j++) {
+			id = touched[j];
+			if (!reachable(shared[id] + key_count - i, key_count,
+			               index->entries[id].trigrams))
+				continue;
+
+			touched[kept++] = id;
+			if (bsearch(&id, lists[i].start,
+			            lists[i].end - lists[i].start, sizeof(id),
+			            &compare_keys) != NULL)
+				shared[id]++;
+		}
+		touched_count = kept;
+	}
+
+	for (i = 0; i < touched_count; i++) {
+		score = (double)shared[touched[i]] /
+		        (key_count + index->entries[touched[i]].trigrams -
+		         shared[touched[i]]);
+		if (score >= SUGGEST_THRESHOLD)
+			found = rank_suggestion(suggestions, found, max, touched[i],
+			                        score);
+	}
+
+	free(keys);
+	free(lists);
+	free(shared);
+	free(touched);
+	return found;
+}
+
+void
+CloseTagIndex(TagIndex *index) {
+	if (index->mapped)
+		munmap(index->base, index->length);
+	else
+		free(index->base);
+	free(index);
+}
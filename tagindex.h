@@ -0,0 +1,28 @@
+#ifndef PYROS_CLI_TAGINDEX_H
+#define PYROS_CLI_TAGINDEX_H
+
+#include <stddef.h>
+
+#include <pyros.h>
+
+typedef struct TagIndex TagIndex;
+
+struct TagSuggestion {
+	size_t tag;
+	double score;
+};
+
+TagIndex *OpenTagIndex(const char *db_path);
+TagIndex *OpenStaleTagIndex(const char *db_path, int *stale);
+TagIndex *BuildTagIndex(const char *db_path, PyrosDB *pyrosDB);
+
+size_t FindTagPrefix(TagIndex *index, const char *prefix, size_t *end);
+const char *TagIndexName(TagIndex *index, size_t i);
+int TagIndexContains(TagIndex *index, const char *tag);
+
+size_t SuggestTags(TagIndex *index, const char *tag,
+                   struct TagSuggestion *suggestions, size_t max);
+
+void CloseTagIndex(TagIndex *index);
+
+#endif
@@ -1,119 +1,493 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "output.h"
 #include "pyros_cli.h"
 #include "tagtree.h"
 
 extern const char *ExecName;
 
-static void
-NewTree(PyrosTag **tag, size_t length, size_t current, TagTree *tree,
-        int depth) {
-	size_t i = current;
-	size_t current_child = 0;
-
-	if (i == (size_t)-1)
-		i = 0;
-
-	tree->capacity = 5;
-	tree->child_count = 0;
-	tree->children = malloc(sizeof(*tree) * tree->capacity);
-	if (tree->children == NULL)
-		goto error;
+/* every node lives in one array laid out breadth first, so the children of
+ * a node are always contiguous and the whole tree is freed at once.
+ * tags are bucketed by parent first so building it is linear */
+static TagTree *
+build_tree(PyrosTag **tag, const char *shared, int length) {
+	size_t count = length;
+	size_t *child_start = calloc(count + 2, sizeof(*child_start));
+	size_t *child_index = malloc(sizeof(*child_index) * (count + 1));
+	size_t *node_tag = malloc(sizeof(*node_tag) * (count + 1));
+	TagTree *tree = malloc(sizeof(*tree) * (count + 1));
+	size_t i, j, slot, next;
+	TagTree *node;
+
+	if (child_start == NULL || child_index == NULL || node_tag == NULL ||
+	    tree == NULL) {
+		ERROR(stderr, "Out of memory");
+		exit(1);
+	}
+
+	/* bucket 0 holds the children of the root, bucket i + 1 those of
+	 * tag i. Tags pointing outside the list are left out */
+	for (i = 0; i < count; i++) {
+		slot = tag[i]->par + 1;
+		if (slot <= count)
+			child_start[slot + 1]++;
+	}
+	for (i = 1; i < count + 2; i++)
+		child_start[i] += child_start[i - 1];
+	for (i = 0; i < count; i++) {
+		slot = tag[i]->par + 1;
+		if (slot <= count)
+			child_index[child_start[slot]++] = i;
+	}
+	/* filling shifted every start to the next bucket's */
+	for (i = count + 1; i > 0; i--)
+		child_start[i] = child_start[i - 1];
+	child_start[0] = 0;
+
+	tree[0].tag = NULL;
+	tree[0].is_Alias = 0;
+	tree[0].is_Shared = 0;
+	tree[0].depth = 0;
+	node_tag[0] = (size_t)-1;
+	next = 1;
+
+	for (i = 0; i < next; i++) {
+		node = &tree[i];
+		slot = node_tag[i] + 1;
+
+		node->children = &tree[next];
+		node->child_count = child_start[slot + 1] - child_start[slot];
 
-	tree->depth = depth;
-
-	for (i = 0; i < length; i++) {
-		if (tag[i]->par == current) {
-			if (current_child + 1 >= tree->capacity) {
-				tree->capacity *= 2;
-				tree->children = realloc(
-				    tree->children,
-				    sizeof(*tree->children) * tree->capacity);
-				if (tree->children == NULL)
-					goto error;
-			}
-			NewTree(tag, length, i, &tree->children[current_child],
-			        depth + 1);
-			tree->children[current_child].tag = tag[i]->tag;
-			tree->children[current_child].is_Alias =
-			    tag[i]->isAlias;
-			current_child++;
-			tree->child_count++;
+		for (j = child_start[slot]; j < child_start[slot + 1]; j++) {
+			tree[next].tag = tag[child_index[j]]->tag;
+			tree[next].is_Alias = tag[child_index[j]]->isAlias;
+			tree[next].is_Shared =
+			    shared != NULL && shared[child_index[j]];
+			tree[next].depth = node->depth + 1;
+			node_tag[next] = child_index[j];
+			next++;
 		}
 	}
 
-	return;
-error:
-	ERROR(stderr, "Out of memory");
-	exit(1);
+	free(child_start);
+	free(child_index);
+	free(node_tag);
+	return tree;
 }
 
 TagTree *
 PyrosTagToTree(PyrosTag **tag, int length) {
-	TagTree *tree = malloc(sizeof(*tree));
-	if (tree == NULL) {
+	return build_tree(tag, NULL, length);
+}
+
+#define FOREST_UNKNOWN ((size_t)-2)
+#define FOREST_SKIPPED ((size_t)-3)
+
+/* the related tags of several roots merged into one forest. a tag is
+ * expanded the first time it shows up, later occurrences are marked
+ * shared and their subtrees left out */
+struct TagForest {
+	PyrosTag *nodes;
+	char *shared;
+	size_t count;
+	size_t capacity;
+
+	/* expanded tags by name, node index + 1 with 0 for empty slots */
+	size_t *table;
+	size_t table_size;
+	size_t expanded;
+
+	PyrosList **lists;
+	size_t list_count;
+};
+
+static void *
+forest_realloc(void *ptr, size_t size) {
+	if ((ptr = realloc(ptr, size)) == NULL) {
 		ERROR(stderr, "Out of memory");
 		exit(1);
 	}
+	return ptr;
+}
 
-	NewTree(tag, length, -1, tree, 0);
-	tree->tag = NULL;
-	tree->is_Alias = 0;
+static size_t
+hash_tag(const char *tag) {
+	size_t hash = 2166136261u;
 
-	return tree;
+	for (; *tag != '\0'; tag++)
+		hash = (hash ^ (unsigned char)*tag) * 16777619u;
+	return hash;
+}
+
+static size_t *
+find_slot(TagForest *forest, const char *tag) {
+	size_t i = hash_tag(tag) & (forest->table_size - 1);
+
+	while (forest->table[i] != 0 &&
+	       strcmp(forest->nodes[forest->table[i] - 1].tag, tag))
+		i = (i + 1) & (forest->table_size - 1);
+	return &forest->table[i];
 }
 
 static void
-printtree(TagTree *tree, int isLastChild, int bar_depth) {
-
-	printf("\033[36;1m");
-	for (int i = 0; i < tree->depth - 1; i++) {
-		if (i + 1 == tree->depth - 1) {
-			if (isLastChild)
-				printf("┕");
-			else
-				printf("┝");
+grow_table(TagForest *forest) {
+	size_t *old = forest->table;
+	size_t old_size = forest->table_size;
+	size_t i;
+
+	forest->table_size = old_size ? old_size * 2 : 64;
+	forest->table = calloc(forest->table_size, sizeof(*forest->table));
+	if (forest->table == NULL) {
+		ERROR(stderr, "Out of memory");
+		exit(1);
+	}
+
+	for (i = 0; i < old_size; i++) {
+		if (old[i] != 0)
+			*find_slot(forest, forest->nodes[old[i] - 1].tag) = old[i];
+	}
+	free(old);
+}
+
+static size_t
+add_node(TagForest *forest, char *tag, int is_alias, size_t parent) {
+	int shared = ForestHasTag(forest, tag);
+	size_t node = forest->count;
+
+	if (forest->count == forest->capacity) {
+		forest->capacity = forest->capacity * 2 + 64;
+		forest->nodes = forest_realloc(
+		    forest->nodes, sizeof(*forest->nodes) * forest->capacity);
+		forest->shared = forest_realloc(
+		    forest->shared, sizeof(*forest->shared) * forest->capacity);
+	}
+
+	forest->nodes[node].tag = tag;
+	forest->nodes[node].isAlias = is_alias;
+	forest->nodes[node].par = parent;
+	forest->shared[node] = shared;
+	forest->count++;
+
+	if (!shared) {
+		if ((forest->expanded + 1) * 2 > forest->table_size)
+			grow_table(forest);
+		*find_slot(forest, tag) = node + 1;
+		forest->expanded++;
+	}
+	return node;
+}
+
+TagForest *
+NewTagForest() {
+	TagForest *forest = calloc(1, sizeof(*forest));
+
+	if (forest == NULL) {
+		ERROR(stderr, "Out of memory");
+		exit(1);
+	}
+	return forest;
+}
+
+int
+ForestHasTag(TagForest *forest, const char *tag) {
+	return forest->table_size > 0 && *find_slot(forest, tag) != 0;
+}
+
+/* a root whose subtree is already in the forest */
+void
+AddSharedRoot(TagForest *forest, char *tag) {
+	add_node(forest, tag, FALSE, (size_t)-1);
+}
+
+/* maps the related tag k onto the forest, first resolving the ancestors
+ * it is waiting on. tags under a shared or skipped one are skipped, as
+ * are cycles in the parent indices */
+static void
+merge_tag(TagForest *forest, PyrosTag **tag, size_t count, size_t *node,
+          size_t *path, size_t k) {
+	size_t depth = 0;
+	size_t parent;
+
+	while (node[k] == FOREST_UNKNOWN && depth < count) {
+		path[depth++] = k;
+		node[k] = FOREST_SKIPPED;
+		if (tag[k]->par >= count)
+			break;
+		k = tag[k]->par;
+	}
+
+	while (depth > 0) {
+		k = path[--depth];
+		if (tag[k]->par >= count) {
+			parent = (size_t)-1;
 		} else {
-			if (i < bar_depth)
-				printf("│");
-			else
-				printf(" ");
+			parent = node[tag[k]->par];
+			if (parent == FOREST_SKIPPED || forest->shared[parent])
+				continue;
 		}
+		node[k] = add_node(forest, tag[k]->tag, tag[k]->isAlias, parent);
 	}
+}
 
-	printf("\033[0m");
+/* takes over related, a result of Pyros_Get_Related_Tags */
+void
+MergeRelated(TagForest *forest, PyrosList *related) {
+	PyrosTag **tag = (PyrosTag **)related->list;
+	size_t count = related->length;
+	size_t *node = malloc(sizeof(*node) * (count + 1));
+	size_t *path = malloc(sizeof(*path) * (count + 1));
+	size_t k;
 
-	printf("%s", tree->tag);
-	if (tree->is_Alias)
-		printf(" \033[36;1m<A>\033[0m\n");
-	else
-		printf("\n");
+	if (node == NULL || path == NULL) {
+		ERROR(stderr, "Out of memory");
+		exit(1);
+	}
 
-	for (int i = 0; i < tree->child_count; i++) {
-		int isLast = i + 1 == tree->child_count;
+	for (k = 0; k < count; k++)
+		node[k] = FOREST_UNKNOWN;
+	for (k = 0; k < count; k++)
+		merge_tag(forest, tag, count, node, path, k);
 
-		if (!isLastChild)
-			bar_depth = tree->depth - 1;
+	forest->lists = forest_realloc(
+	    forest->lists, sizeof(*forest->lists) * (forest->list_count + 1));
+	forest->lists[forest->list_count++] = related;
+	free(node);
+	free(path);
+}
+
+TagTree *
+ForestToTree(TagForest *forest) {
+	PyrosTag **tags = malloc(sizeof(*tags) * (forest->count + 1));
+	TagTree *tree;
+	size_t i;
 
-		printtree(&tree->children[i], isLast, bar_depth);
+	if (tags == NULL) {
+		ERROR(stderr, "Out of memory");
+		exit(1);
 	}
+	for (i = 0; i < forest->count; i++)
+		tags[i] = &forest->nodes[i];
+
+	tree = build_tree(tags, forest->shared, forest->count);
+	free(tags);
+	return tree;
 }
+
 void
-PrintTree(TagTree *root) {
-	for (int i = 0; i < root->child_count; i++) {
-		int isLast = i + 1 == root->child_count;
-		printtree(&root->children[i], isLast, 0);
+DestroyForest(TagForest *forest) {
+	size_t i;
+
+	for (i = 0; i < forest->list_count; i++)
+		Pyros_List_Free(forest->lists[i],
+		                (Pyros_Free_Callback)Pyros_Free_Tag);
+	free(forest->lists);
+	free(forest->nodes);
+	free(forest->shared);
+	free(forest->table);
+	free(forest);
+}
+
+#define TREE_COLOR "\033[36;1m"
+#define TREE_RESET "\033[0m"
+
+struct TreeFrame {
+	TagTree *node;
+	TagTree *parent;
+	int index;
+	int is_last;
+	int bar_depth;
+	int next_child;
+};
+
+struct TreeRender {
+	OutputWriter *out;
+	int color;
+};
+
+typedef void (*TreeVisit)(struct TreeRender *r, struct TreeFrame *frame);
+
+/* walks the tree depth first without recursing, calling enter before a
+ * node's children and leave after them */
+static void
+walk_tree(TagTree *root, struct TreeRender *r, TreeVisit enter,
+          TreeVisit leave) {
+	struct TreeFrame *stack;
+	struct TreeFrame *top;
+	struct TreeFrame *child;
+	size_t depth = 1;
+	size_t capacity = 64;
+
+	if ((stack = malloc(sizeof(*stack) * capacity)) == NULL)
+		goto error;
+
+	stack[0].node = root;
+	stack[0].parent = NULL;
+	stack[0].index = 0;
+	stack[0].is_last = TRUE;
+	stack[0].bar_depth = 0;
+	stack[0].next_child = 0;
+
+	while (depth > 0) {
+		top = &stack[depth - 1];
+
+		if (top->next_child == top->node->child_count) {
+			if (depth > 1 && leave != NULL)
+				leave(r, top);
+			depth--;
+			continue;
+		}
+
+		if (depth == capacity) {
+			capacity *= 2;
+			stack = realloc(stack, sizeof(*stack) * capacity);
+			if (stack == NULL)
+				goto error;
+			top = &stack[depth - 1];
+		}
+
+		child = &stack[depth++];
+		child->node = &top->node->children[top->next_child];
+		child->parent = top->node;
+		child->index = top->next_child;
+		child->is_last = top->next_child + 1 == top->node->child_count;
+		child->next_child = 0;
+		if (top->is_last)
+			child->bar_depth = top->bar_depth;
+		else
+			child->bar_depth = top->node->depth - 1;
+
+		top->next_child++;
+		enter(r, child);
+	}
+
+	free(stack);
+	return;
+error:
+	ERROR(stderr, "Out of memory");
+	exit(1);
+}
+
+static void
+enter_tree(struct TreeRender *r, struct TreeFrame *frame) {
+	int depth = frame->node->depth;
+
+	if (r->color)
+		WriteString(r->out, TREE_COLOR);
+	for (int i = 0; i < depth - 1; i++) {
+		if (i + 1 == depth - 1)
+			WriteString(r->out, frame->is_last ? "┕" : "┝");
+		else
+			WriteString(r->out, i < frame->bar_depth ? "│" : " ");
+	}
+	if (r->color)
+		WriteString(r->out, TREE_RESET);
+
+	WriteString(r->out, frame->node->tag);
+	if (frame->node->is_Alias)
+		WriteString(r->out, r->color ? " " TREE_COLOR "<A>" TREE_RESET
+		                           : " <A>");
+	if (frame->node->is_Shared)
+		WriteString(r->out, r->color ? " " TREE_COLOR "<S>" TREE_RESET
+		                           : " <S>");
+	WriteString(r->out, "\n");
+}
+
+static void
+enter_json(struct TreeRender *r, struct TreeFrame *frame) {
+	WriteString(r->out, frame->index > 0 ? ",{\"tag\":" : "{\"tag\":");
+	WriteJSONString(r->out, frame->node->tag);
+	WriteString(r->out, frame->node->is_Alias ? ",\"alias\":true"
+	                                        : ",\"alias\":false");
+	if (frame->node->is_Shared)
+		WriteString(r->out, ",\"shared\":true");
+	WriteString(r->out, ",\"children\":[");
+}
+
+static void
+leave_json(struct TreeRender *r, struct TreeFrame *frame) {
+	UNUSED(frame);
+	WriteString(r->out, "]}");
+}
+
+static void
+write_dot_string(OutputWriter *out, const char *str) {
+	WriteString(out, "\"");
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\')
+			WriteString(out, "\\");
+		if (*str == '\n')
+			WriteString(out, "\\n");
+		else
+			WriteOutput(out, str, 1);
 	}
+	WriteString(out, "\"");
+}
+
+static void
+enter_dot(struct TreeRender *r, struct TreeFrame *frame) {
+	WriteString(r->out, "\t");
+	if (frame->parent->tag != NULL) {
+		write_dot_string(r->out, frame->parent->tag);
+		WriteString(r->out, " -> ");
+	}
+	write_dot_string(r->out, frame->node->tag);
+	if (frame->node->is_Alias && frame->parent->tag != NULL)
+		WriteString(r->out, " [style=dashed]");
+	else if (frame->node->is_Shared && frame->parent->tag != NULL)
+		WriteString(r->out, " [style=dotted]");
+	WriteString(r->out, ";\n");
+}
+
+/* parent, tag, relation and depth, top level tags have no parent. tags
+ * expanded elsewhere in the forest get a fifth "shared" column */
+static void
+enter_tsv(struct TreeRender *r, struct TreeFrame *frame) {
+	char depth[16];
+
+	if (frame->parent->tag != NULL)
+		WriteTSVField(r->out, frame->parent->tag);
+	WriteString(r->out, "\t");
+	WriteTSVField(r->out, frame->node->tag);
+	WriteString(r->out, frame->node->is_Alias ? "\talias\t" : "\tchild\t");
+	sprintf(depth, "%d%s\n", frame->node->depth,
+	        frame->node->is_Shared ? "\tshared" : "");
+	WriteString(r->out, depth);
 }
 
 void
-DestroyTree(TagTree *tree) {
-	for (int i = 0; i < tree->child_count; i++)
-		DestroyTree(&tree->children[i]);
+PrintTree(TagTree *root, enum TREE_FORMAT format) {
+	struct TreeRender r;
+
+	r.out = NewOutputWriter(STDOUT_FILENO, '\n');
+	r.color = isatty(STDOUT_FILENO);
 
-	free(tree->children);
+	switch (format) {
+	case TREE_FORMAT_TREE:
+		walk_tree(root, &r, &enter_tree, NULL);
+		break;
+	case TREE_FORMAT_JSON:
+		WriteString(r.out, "[");
+		walk_tree(root, &r, &enter_json, &leave_json);
+		WriteString(r.out, "]\n");
+		break;
+	case TREE_FORMAT_DOT:
+		WriteString(r.out, "digraph related {\n");
+		walk_tree(root, &r, &enter_dot, NULL);
+		WriteString(r.out, "}\n");
+		break;
+	case TREE_FORMAT_TSV:
+		walk_tree(root, &r, &enter_tsv, NULL);
+		break;
+	}
 
-	if (tree->depth == 0)
-		free(tree);
+	CloseOutputWriter(r.out);
+}
+
+void
+DestroyTree(TagTree *tree) {
+	free(tree);
 }
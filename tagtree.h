@@ -6,15 +6,31 @@
 typedef struct TagTree {
 	struct TagTree *children;
 	int child_count;
-	size_t capacity;
 	char *tag;
 	int is_Alias;
+	int is_Shared;
 	int depth;
 } TagTree;
 
+typedef struct TagForest TagForest;
+
+enum TREE_FORMAT {
+	TREE_FORMAT_TREE,
+	TREE_FORMAT_JSON,
+	TREE_FORMAT_DOT,
+	TREE_FORMAT_TSV,
+};
+
 TagTree *PyrosTagToTree(PyrosTag **tag, int length);
 
-void PrintTree(TagTree *tree);
+TagForest *NewTagForest();
+int ForestHasTag(TagForest *forest, const char *tag);
+void AddSharedRoot(TagForest *forest, char *tag);
+void MergeRelated(TagForest *forest, PyrosList *related);
+TagTree *ForestToTree(TagForest *forest);
+void DestroyForest(TagForest *forest);
+
+void PrintTree(TagTree *tree, enum TREE_FORMAT format);
 void DestroyTree(TagTree *tree);
 
 #endif